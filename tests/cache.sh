@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Check that --cache remembers the armoured texts the command succeeded
+# on, so that they are not passed to the command again, while those the
+# command failed on are.
+
+. "${srcdir:-.}/tests/lib.sh"
+
+f=$tmp/cache.pem
+{
+    block A 1
+    printf 'noise\n'
+    block B 2
+    block A 1
+    block C 3
+} > "$f"
+mkdir "$tmp/cache" "$tmp/small" || exit 99
+
+# log each armoured text passed to the command, failing on B
+cmd='cat > /dev/null; echo $XARMOUR_LABEL >> "$0"; [ $XARMOUR_LABEL != B ]'
+
+"$XARMOUR" -f "$f" -t 1 --cache "$tmp/cache" --stats \
+    -- sh -c "$cmd" "$tmp/log" 2> "$tmp/err1" > /dev/null \
+    || fail "first run failed"
+printf 'A\nB\nC\n' | cmp -s - "$tmp/log" \
+    || fail "first run did not pass each armoured text once"
+grep -q 'cache hits: 1, cache misses: 3' "$tmp/err1" \
+    || fail "first run did not find the copy of A in the cache"
+
+: > "$tmp/log"
+"$XARMOUR" -f "$f" -t 1 --cache "$tmp/cache" --stats \
+    -- sh -c "$cmd" "$tmp/log" 2> "$tmp/err2" > /dev/null \
+    || fail "second run failed"
+printf 'B\n' | cmp -s - "$tmp/log" \
+    || fail "second run did not pass B alone"
+grep -q 'cache hits: 3, cache misses: 1' "$tmp/err2" \
+    || fail "second run did not find A and C in the cache"
+
+# a different command is another key
+: > "$tmp/log"
+"$XARMOUR" -f "$f" -t 1 --cache "$tmp/cache" \
+    -- sh -c "true; $cmd" "$tmp/log" > /dev/null 2>&1 \
+    || fail "run with another command failed"
+printf 'A\nB\nC\n' | cmp -s - "$tmp/log" \
+    || fail "run with another command used the cache"
+
+# commands that differ with each armoured text cannot be cached
+"$XARMOUR" -f "$f" --cache "$tmp/cache" -- echo {index} \
+    > /dev/null 2>&1 && fail "command with {index} was cached"
+"$XARMOUR" -f "$f" --cache "$tmp/cache" -- echo {label} > /dev/null \
+    || fail "command with {label} was refused"
+
+"$XARMOUR" -f "$f" --cache "$tmp/small" --cache-size 1 -- true \
+    > /dev/null 2>&1 && fail "cache of one byte was made"
+
+exit 0
@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# Check that compressed input and tar archives give the same armoured
+# texts as the plain files within, read from a file or from a pipe, and
+# that armour arriving on a pipe is not held back waiting for more.
+
+. "${srcdir:-.}/tests/lib.sh"
+
+CONFIG_H=${CONFIG_H:-$PWD/config.h}
+
+# have feature: whether xarmour was built with the feature
+have() {
+    grep -q "^#define HAVE_$1 1" "$CONFIG_H"
+}
+
+# run name args...: search the input given, keeping the results without
+# the names of the file and member, and the output of the command
+run() {
+    name=$1
+    shift
+    "$XARMOUR" "$@" --results "$tmp/$name.r" -- cksum > "$tmp/$name.o" \
+        || fail "search of $name failed"
+    results "$tmp/$name.r" | sed 's/"file":"[^"]*",//; s/"member":"[^"]*",//' \
+        > "$tmp/$name.n"
+}
+
+# same name reference: whether the search of name matched the reference
+same() {
+    cmp -s "$tmp/$1.n" "$tmp/$2.n" && cmp -s "$tmp/$1.o" "$tmp/$2.o" \
+        || fail "search of $1 differs from $2"
+}
+
+cd "$tmp" || exit 99
+
+{
+    printf 'noise\0with\0NUL\0bytes\n'
+    block A 1
+    printf 'noise\n'
+    block B 2
+} > p.pem
+block C 3 > q.pem
+
+run plain -f p.pem
+run plains -f p.pem -f q.pem
+
+for z in gzip:ZLIB:gz xz:LZMA:xz zstd:ZSTD:zst; do
+
+    tool=${z%%:*}
+    feature=${z#*:}
+    feature=${feature%:*}
+    suffix=${z##*:}
+
+    if ! have "$feature" || ! command -v "$tool" > /dev/null; then
+        echo "$0: skipping $tool"
+        continue
+    fi
+
+    "$tool" -c p.pem > "p.pem.$suffix" || exit 99
+    run "$suffix" -f "p.pem.$suffix"
+    same "$suffix" plain
+    run "$suffix-pipe" < "p.pem.$suffix"
+    same "$suffix-pipe" plain
+
+done
+
+if command -v tar > /dev/null; then
+
+    tar cf t.tar p.pem q.pem || exit 99
+
+    run tar -f t.tar
+    same tar plains
+    run tar-pipe < t.tar
+    same tar-pipe plains
+
+    sed -n 's/.*"member":"\([^"]*\)".*/\1/p' "$tmp/tar.r" > members
+    printf 'p.pem\np.pem\nq.pem\n' | cmp -s - members \
+        || fail "members of the archive were not named"
+
+    if have ZLIB && command -v gzip > /dev/null; then
+        gzip -c t.tar > t.tgz || exit 99
+        run tgz -f t.tgz
+        same tgz plains
+    fi
+
+else
+    echo "$0: skipping tar"
+fi
+
+# armour on a pipe is processed while the writer waits for it to be
+: > early
+(
+    block A 1
+    i=0
+    while [ ! -f ran ] && [ $i -lt 10 ]; do
+        sleep 1
+        i=$((i + 1))
+    done
+    [ -f ran ] || rm -f early
+) | "$XARMOUR" -- sh -c 'cat > /dev/null; touch ran' > /dev/null \
+    || fail "search of a pipe failed"
+[ -f early ] || fail "armour on a pipe was held back until the pipe closed"
+
+exit 0
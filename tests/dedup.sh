@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Check that --dedup passes each armoured text to the command once, and
+# that --dedup-count counts the copies as successes.
+
+. "${srcdir:-.}/tests/lib.sh"
+
+f=$tmp/dedup.pem
+{
+    block A 1
+    block B 2
+    printf 'noise\0\n'
+    block A 1
+    block C 3
+    block C 3
+} > "$f"
+
+# log the index and label of each armoured text passed to the command
+cmd='cat > /dev/null; echo $XARMOUR_INDEX $XARMOUR_LABEL >> "$0"'
+
+"$XARMOUR" -f "$f" --dedup -- sh -c "$cmd" "$tmp/log" \
+    || fail "--dedup failed"
+printf '0 A\n1 B\n3 C\n' | cmp -s - "$tmp/log" \
+    || fail "--dedup did not pass each armoured text once"
+
+# the copies count as successes only with --dedup-count
+"$XARMOUR" -f "$f" --dedup -t 5 -- true > /dev/null 2>&1 \
+    && fail "--dedup counted the copies"
+"$XARMOUR" -f "$f" --dedup-count -t 5 -- true > /dev/null 2>&1 \
+    || fail "--dedup-count did not count the copies"
+
+# armour printed or split is never compared
+for opt in --print --print0 "--split-dir $tmp"; do
+    "$XARMOUR" -f "$f" --dedup $opt > /dev/null 2>&1 \
+        && fail "--dedup was accepted with $opt"
+done
+
+exit 0
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Check that --follow picks up a line still being written, holding NUL
+# bytes, and that the offsets found match those of the whole file.
+
+. "${srcdir:-.}/tests/lib.sh"
+
+f=$tmp/follow.pem
+{
+    printf '\0\0noise\n'
+    block A 1
+    printf '\0partial\0line'
+} > "$f"
+
+"$XARMOUR" --follow --index 0-1 -f "$f" --results "$tmp/followed" \
+    -- cksum > /dev/null &
+pid=$!
+
+# wait for A, then complete the line and append the rest
+i=0
+while [ ! -s "$tmp/followed" ] && [ $i -lt 10 ]; do
+    sleep 1
+    i=$((i + 1))
+done
+{
+    printf ' still\0being written\n'
+    block B 2
+    block C 3
+} >> "$f"
+
+i=0
+while kill -0 $pid 2> /dev/null && [ $i -lt 10 ]; do
+    sleep 1
+    i=$((i + 1))
+done
+if kill -0 $pid 2> /dev/null; then
+    kill $pid
+    fail "--follow did not stop once past the last index"
+fi
+wait $pid || fail "--follow failed"
+
+"$XARMOUR" --index 0-1 -f "$f" --results "$tmp/whole" -- cksum > /dev/null \
+    || fail "search of the whole file failed"
+
+results "$tmp/followed" > "$tmp/a"
+results "$tmp/whole" > "$tmp/b"
+[ "$(wc -l < "$tmp/a")" -eq 2 ] || fail "--follow did not find A and B"
+cmp -s "$tmp/a" "$tmp/b" || fail "offsets found by --follow differ"
+[ "$(sed -n '2s/.*"offset":\([0-9]*\).*/\1/p' "$tmp/a")" -eq \
+    "$(grep -abo -e '-----BEGIN B' "$f" | sed 's/:.*//')" ] \
+    || fail "offset of B is wrong"
+
+exit 0
@@ -0,0 +1,25 @@
+# Helpers shared by the xarmour check scripts, sourced by each of them.
+
+XARMOUR=${XARMOUR:-$PWD/xarmour}
+
+tmp=$(mktemp -d) || exit 99
+trap 'rm -rf "$tmp"' EXIT
+
+# fail message: report a failed check and give up
+fail() {
+    echo "$0: $*" >&2
+    exit 1
+}
+
+# block label seed: an armoured text whose body differs with the seed
+block() {
+    printf -- '-----BEGIN %s-----\n' "$1"
+    printf 'TWFueSBoYW5kcyBtYWtlIGxpZ2h0IHdvcmsu%s\n' "$2"
+    printf 'bGlnaHQgd29yay4=\n'
+    printf -- '-----END %s-----\n' "$1"
+}
+
+# results file: the results written by --results, without the timings
+results() {
+    sed 's/,"wall":.*}$/}/' "$1"
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Check that the offsets recorded by --checkpoint count every byte read,
+# NUL bytes and all, and that --resume picks up after the last armoured
+# text processed, from a file and from stdin.
+
+. "${srcdir:-.}/tests/lib.sh"
+
+f=$tmp/resume.pem
+{
+    printf 'noise\0with\0NUL\0bytes\n'
+    head -c 200 /dev/zero
+    printf '\n'
+    block A 1
+    printf '\0\0\n'
+    block B 2
+    head -c 100 /dev/zero
+    printf 'noise\n'
+    block C 3
+    printf '\0\n'
+} > "$f"
+size=$(wc -c < "$f")
+
+# the offsets found searching line by line match the bytes in the file
+"$XARMOUR" -f "$f" --results "$tmp/all" -- cksum > /dev/null \
+    || fail "search failed"
+[ "$(sed -n '3s/.*"offset":\([0-9]*\).*/\1/p' "$tmp/all")" -eq \
+    "$(grep -abo -e '-----BEGIN C' "$f" | sed 's/:.*//')" ] \
+    || fail "offset of the last armoured text is wrong"
+
+# read to the end, the checkpoint records the size of stdin, or that
+# the file is done
+"$XARMOUR" --checkpoint "$tmp/stdin.cp" -- cksum < "$f" > /dev/null \
+    || fail "search of stdin failed"
+grep -qx "offset $size" "$tmp/stdin.cp" \
+    || fail "checkpoint of stdin does not record $size bytes read"
+
+"$XARMOUR" -f "$f" --checkpoint "$tmp/file.cp" -- cksum > /dev/null \
+    || fail "search of a file failed"
+grep -qx "input 1" "$tmp/file.cp" \
+    || fail "checkpoint of a file does not record the file as done"
+
+# a checkpoint left once B was processed, after which only C remains
+b=$(sed -n '2s/.*"offset":\([0-9]*\),"length":\([0-9]*\).*/\1 \2/p' \
+    "$tmp/all")
+set -- $b
+results "$tmp/all" | sed -n 3p > "$tmp/c"
+
+for path in "$f" stdin; do
+
+    printf 'xarmour-checkpoint 1\ninput 0\npath %s\noffset %s\n' \
+        "$path" $(($1 + $2)) > "$tmp/resume.cp"
+    printf 'index 2\ncount 2\ncounted 0\n' >> "$tmp/resume.cp"
+
+    if [ "$path" = stdin ]; then
+        "$XARMOUR" --checkpoint "$tmp/resume.cp" --resume \
+            --results "$tmp/resumed" -- cksum < "$f" > "$tmp/out"
+    else
+        "$XARMOUR" -f "$f" --checkpoint "$tmp/resume.cp" --resume \
+            --results "$tmp/resumed" -- cksum > "$tmp/out"
+    fi || fail "resume from $path failed"
+
+    results "$tmp/resumed" | sed 's/"file":"[^"]*",//' > "$tmp/r"
+    sed 's/"file":"[^"]*",//' "$tmp/c" | cmp -s - "$tmp/r" \
+        || fail "resume from $path did not pick up at C"
+    block C 3 | cksum | cmp -s - "$tmp/out" \
+        || fail "resume from $path passed more than C"
+    [ "$path" = stdin ] && ! grep -qx "offset $size" "$tmp/resume.cp" \
+        && fail "checkpoint of stdin resumed does not record $size bytes"
+
+done
+
+exit 0
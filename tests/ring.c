@@ -0,0 +1,187 @@
+/**
+ *    Copyright (C) 2025 Graham Leggett <minfrin@sharp.fm>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+ * Stress the ring the scan threads hand armour over through, with
+ * several threads pushing and popping batches at once around a small
+ * ring. Built with ThreadSanitizer where the compiler supports it.
+ */
+
+#define main xarmour_main
+#include "../xarmour.c"
+#undef main
+
+#ifdef HAVE_SCAN
+
+#define RING_SIZE 64
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define PER_PRODUCER 200000
+#define TOTAL (PRODUCERS * PER_PRODUCER)
+
+typedef struct stress_t {
+    ring_t ring;
+    atomic_long popped;
+    atomic_int broken;
+    atomic_uchar *seen;
+} stress_t;
+
+typedef struct stress_arg_t {
+    stress_t *st;
+    long int id;
+} stress_arg_t;
+
+static void *producer(void *arg)
+{
+    stress_arg_t *a = arg;
+    stress_t *st = a->st;
+    extent_t batch[16];
+    unsigned int seed = a->id;
+    long int next = 0;
+    int spins = 0;
+
+    while (next < PER_PRODUCER) {
+        size_t want = 1 + rand_r(&seed) % 16, n, i;
+
+        for (i = 0; i < want && next + (long int)i < PER_PRODUCER; i++) {
+            long int v = a->id * PER_PRODUCER + next + i;
+
+            batch[i].begin = v;
+            batch[i].body = v + 1;
+            batch[i].tail = v + 2;
+            batch[i].end = v + 3;
+            batch[i].index = v;
+        }
+
+        n = ring_push(&st->ring, batch, i);
+        if (!n) {
+            backoff(&spins);
+            continue;
+        }
+
+        next += n;
+        spins = 0;
+    }
+
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    stress_arg_t *a = arg;
+    stress_t *st = a->st;
+    extent_t batch[16];
+    unsigned int seed = a->id;
+    int spins = 0;
+
+    while (atomic_load(&st->popped) < TOTAL) {
+        size_t n, i;
+
+        n = ring_pop(&st->ring, batch, 1 + rand_r(&seed) % 16);
+        if (!n) {
+            backoff(&spins);
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            extent_t *e = &batch[i];
+
+            /* a torn extent, or one handed out twice */
+            if (e->index < 0 || e->index >= TOTAL || e->begin != e->index
+                    || e->body != e->index + 1 || e->tail != e->index + 2
+                    || e->end != e->index + 3
+                    || atomic_exchange(&st->seen[e->index], 1)) {
+                atomic_store(&st->broken, 1);
+            }
+        }
+
+        atomic_fetch_add(&st->popped, n);
+        spins = 0;
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+    stress_arg_t pargs[PRODUCERS], cargs[CONSUMERS];
+    stress_t st;
+    long int i;
+
+    if (ring_init(&st.ring, RING_SIZE)) {
+        fprintf(stderr, "ring: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    atomic_init(&st.popped, 0);
+    atomic_init(&st.broken, 0);
+
+    st.seen = calloc(TOTAL, sizeof(atomic_uchar));
+    if (!st.seen) {
+        fprintf(stderr, "ring: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < CONSUMERS; i++) {
+        cargs[i].st = &st;
+        cargs[i].id = i;
+        pthread_create(&consumers[i], NULL, consumer, &cargs[i]);
+    }
+
+    for (i = 0; i < PRODUCERS; i++) {
+        pargs[i].st = &st;
+        pargs[i].id = i;
+        pthread_create(&producers[i], NULL, producer, &pargs[i]);
+    }
+
+    for (i = 0; i < PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+    }
+
+    for (i = 0; i < CONSUMERS; i++) {
+        pthread_join(consumers[i], NULL);
+    }
+
+    if (atomic_load(&st.broken) || atomic_load(&st.popped) != TOTAL) {
+        fprintf(stderr, "ring: %ld of %d extents popped intact\n",
+                atomic_load(&st.popped), TOTAL);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < TOTAL; i++) {
+        if (!atomic_load(&st.seen[i])) {
+            fprintf(stderr, "ring: extent %ld lost\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    free(st.seen);
+    free(st.ring.slots);
+
+    return 0;
+}
+
+#else
+
+int main(void)
+{
+    /* no scan threads, nothing to test */
+    return 77;
+}
+
+#endif
@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Search a file bigger than a scan chunk with and without --scan-threads,
+# and check that the armoured texts found, and the output of the command
+# run on each, are the same. Armour is placed across the chunk boundaries,
+# with nested BEGIN lines, and NUL bytes in the noise.
+
+. "${srcdir:-.}/tests/lib.sh"
+
+f=$tmp/scan.pem
+: > "$f"
+
+# pad_to offset: fill the file with noise up to offset, ending in a newline
+pad_to() {
+    n=$(($1 - $(wc -c < "$f") - 1))
+    yes 'noise between the armoured texts' | head -c "$n" >> "$f"
+    printf '\n' >> "$f"
+}
+
+# noise: a line of noise containing NUL bytes
+noise() {
+    printf 'noise\0with\0NUL\0bytes\n' >> "$f"
+    head -c 300 /dev/zero >> "$f"
+    printf '\n' >> "$f"
+}
+
+chunk=16777216
+
+block FIRST 1 >> "$f"
+noise
+
+# armour whose body runs across the first boundary
+pad_to $((chunk - 60))
+block STRADDLE 2 >> "$f"
+noise
+
+# a BEGIN line cut in two by the second boundary
+pad_to $((2 * chunk - 10))
+block CUT 3 >> "$f"
+noise
+
+# armour opened before the third boundary with another BEGIN line nested
+# after it, which a thread searching the next chunk finds and must drop
+pad_to $((3 * chunk - 30))
+printf -- '-----BEGIN OUTER-----\nb3V0ZXI=\nb3V0ZXI=\n' >> "$f"
+block INNER 4 >> "$f"
+printf -- '-----END OUTER-----\n' >> "$f"
+noise
+
+# armour with a mismatched END line, then armour left unended by the end
+# of the file
+block AFTER 5 >> "$f"
+printf -- '-----BEGIN ODD-----\nb2Rk\n-----END EVEN-----\n' >> "$f"
+printf -- '-----END ODD-----\n' >> "$f"
+noise
+block LAST 6 >> "$f"
+printf -- '-----BEGIN UNENDED-----\nZW5k\n' >> "$f"
+
+# a second file, searched ahead while the first is processed
+g=$tmp/more.pem
+for i in 1 2 3; do
+    block MORE "$i"
+    printf 'noise\0\n'
+done > "$g"
+
+"$XARMOUR" -f "$f" -f "$g" --results "$tmp/r0" -- cksum > "$tmp/o0" \
+    || fail "search without threads failed"
+"$XARMOUR" --scan-threads 4 -f "$f" -f "$g" --results "$tmp/r4" -- cksum \
+    > "$tmp/o4" || fail "search with threads failed"
+
+[ "$(wc -l < "$tmp/r0")" -eq 11 ] || fail "expected 11 armoured texts"
+
+results "$tmp/r0" > "$tmp/n0"
+results "$tmp/r4" > "$tmp/n4"
+cmp -s "$tmp/n0" "$tmp/n4" || fail "results differ with --scan-threads"
+cmp -s "$tmp/o0" "$tmp/o4" || fail "output differs with --scan-threads"
+
+exit 0
@@ -15,35 +15,501 @@
  *
  */
 
+#include "config.h"
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <limits.h>
+#include <poll.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_STDATOMIC_H)
+#define HAVE_SCAN 1
+#endif
+#if defined(HAVE_ZSTD) && defined(HAVE_SCAN)
+#define HAVE_DECODE_THREAD 1
+#endif
+#include <regex.h>
+#include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_INOTIFY_INIT1
+#include <sys/inotify.h>
+#endif
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
-#include "config.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define MAX_LINE 1024
+#define MAX_BUFFERED (64 * 1024 * 1024)
+#define MAX_SLAB (1024 * 1024)
+#define MAX_SPILL (16 * 1024 * 1024)
+#define READERS 4
+#define READ_AHEAD 16
+#define TAR_BLOCK 512
+#define DECODE_MAGIC 6
+#define SCAN_CHUNK (16 * 1024 * 1024)
+#define SCAN_BODY (1024 * 1024)
+#define SCAN_RING 4096
+#define FOLLOW_INTERVAL 1000
+#define CHECKPOINT_INTERVAL 10
+#define CACHE_MAGIC "xacache1"
+#define CACHE_PROBE 16
+#define CACHE_TTL (7 * 24 * 60 * 60)
+#define CACHE_SIZE (16 * 1024 * 1024)
+#define CACHE_MIN (sizeof(cache_header_t) + CACHE_PROBE * sizeof(cache_slot_t))
+
+#define ARMOUR_BEGIN "-----BEGIN %1000[^-]-----"
+#define ARMOUR_END "-----END %1000[^-]-----"
 
 #define READ_FD 0
 #define WRITE_FD 1
 
+/* long options without a short equivalent */
+enum {
+    OPT_RESULTS = 256,
+    OPT_RESULTS_OUTPUT,
+    OPT_TAG,
+    OPT_ON,
+    OPT_LABEL,
+    OPT_EXCLUDE_LABEL,
+    OPT_INDEX,
+    OPT_PRINT,
+    OPT_PRINT0,
+    OPT_SPLIT_DIR,
+    OPT_SPLIT_NAME,
+    OPT_PREALLOCATE,
+    OPT_FSYNC,
+    OPT_MAX_BLOCKS,
+    OPT_MAX_BYTES,
+    OPT_COUNT_BLOCKS,
+    OPT_GROUP_BY_LABEL,
+    OPT_MEMFD,
+    OPT_MAX_BUFFERED_BYTES,
+    OPT_STATS,
+    OPT_SPILL_BYTES,
+    OPT_SCAN_THREADS,
+    OPT_FOLLOW,
+    OPT_CHECKPOINT,
+    OPT_RESUME,
+    OPT_CACHE,
+    OPT_CACHE_TTL,
+    OPT_CACHE_SIZE,
+    OPT_DEDUP,
+    OPT_DEDUP_COUNT
+};
+
 static struct option long_options[] =
 {
     {"file", required_argument, NULL, 'f'},
+    {"recursive", no_argument, NULL, 'r'},
     {"times", required_argument, NULL, 't'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"keep-order", no_argument, NULL, 'k'},
+    {"tag", no_argument, NULL, OPT_TAG},
+    {"on", required_argument, NULL, OPT_ON},
+    {"label", required_argument, NULL, OPT_LABEL},
+    {"exclude-label", required_argument, NULL, OPT_EXCLUDE_LABEL},
+    {"index", required_argument, NULL, OPT_INDEX},
+    {"print", no_argument, NULL, OPT_PRINT},
+    {"print0", no_argument, NULL, OPT_PRINT0},
+    {"split-dir", required_argument, NULL, OPT_SPLIT_DIR},
+    {"split-name", required_argument, NULL, OPT_SPLIT_NAME},
+    {"preallocate", no_argument, NULL, OPT_PREALLOCATE},
+    {"fsync", no_argument, NULL, OPT_FSYNC},
+    {"max-blocks", required_argument, NULL, OPT_MAX_BLOCKS},
+    {"max-bytes", required_argument, NULL, OPT_MAX_BYTES},
+    {"count-blocks", no_argument, NULL, OPT_COUNT_BLOCKS},
+    {"group-by-label", no_argument, NULL, OPT_GROUP_BY_LABEL},
+    {"memfd", no_argument, NULL, OPT_MEMFD},
+    {"max-buffered-bytes", required_argument, NULL, OPT_MAX_BUFFERED_BYTES},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"spill-bytes", required_argument, NULL, OPT_SPILL_BYTES},
+    {"scan-threads", required_argument, NULL, OPT_SCAN_THREADS},
+    {"follow", no_argument, NULL, OPT_FOLLOW},
+    {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+    {"resume", no_argument, NULL, OPT_RESUME},
+    {"cache", required_argument, NULL, OPT_CACHE},
+    {"cache-ttl", required_argument, NULL, OPT_CACHE_TTL},
+    {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+    {"dedup", no_argument, NULL, OPT_DEDUP},
+    {"dedup-count", no_argument, NULL, OPT_DEDUP_COUNT},
+    {"results", required_argument, NULL, OPT_RESULTS},
+    {"results-output", no_argument, NULL, OPT_RESULTS_OUTPUT},
     {"help", no_argument, NULL, 'h'},
     {"version", no_argument, NULL, 'v'},
     {NULL, 0, NULL, 0}
 };
 
+/*
+ * A node in the trie of exact and prefix patterns. Children are held as
+ * a linked list of siblings, which stays small for the character set
+ * found in armour labels.
+ */
+typedef struct match_node_t {
+    int next;
+    int sibling;
+    int exact;
+    int prefix;
+    unsigned char ch;
+} match_node_t;
+
+/*
+ * A glob or regular expression pattern that cannot live in the trie.
+ */
+typedef struct match_pattern_t {
+    const char *glob;
+    regex_t *re;
+    int value;
+} match_pattern_t;
+
+/*
+ * A precompiled set of label patterns, each associated with a value.
+ *
+ * Exact and prefix patterns are compiled into a trie, so that a label is
+ * matched against any number of them in a single pass over the label.
+ * Glob and regular expression patterns are tried in the order given once
+ * the trie has no match.
+ */
+typedef struct matcher_t {
+    match_node_t *nodes;
+    int nnodes;
+    int anodes;
+    match_pattern_t *patterns;
+    int npatterns;
+} matcher_t;
+
+/*
+ * An inclusive range of indexes, where a negative end is unbounded.
+ */
+typedef struct range_t {
+    long int from;
+    long int to;
+} range_t;
+
+/*
+ * A growable buffer holding a complete armoured text.
+ */
+typedef struct buffer_t {
+    char *data;
+    size_t len;
+    size_t size;
+} buffer_t;
+
+/*
+ * The running state of a SHA-256 digest.
+ */
+typedef struct sha256_t {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char block[64];
+    size_t used;
+} sha256_t;
+
+/*
+ * Kinds of placeholder found in a template.
+ */
+typedef enum template_e {
+    TPL_LITERAL,
+    TPL_INDEX,
+    TPL_LABEL,
+    TPL_FINGERPRINT,
+    TPL_COUNT,
+    TPL_OFFSET,
+    TPL_FILE
+} template_e;
+
+/*
+ * A template, parsed once into literal text and placeholders, so that
+ * expanding it costs no more than copying.
+ */
+typedef struct template_t {
+    template_e *kinds;
+    char **literals;
+    int nparts;
+} template_t;
+
+/*
+ * The values substituted into a template.
+ */
+typedef struct template_vars_t {
+    const char *index;
+    const char *label;
+    const char *fingerprint;
+    const char *file;
+    long int count;
+    long long offset;
+} template_vars_t;
+
+/*
+ * Commands implemented within xarmour, run without fork() or exec().
+ */
+typedef enum builtin_e {
+    BUILTIN_NONE = -1,
+    BUILTIN_NULL,
+    BUILTIN_CAT,
+    BUILTIN_COUNT,
+    BUILTIN_WC,
+    BUILTIN_SHA256
+} builtin_e;
+
+static const char *builtin_names[] = {
+    "@null", "@cat", "@count", "@wc", "@sha256", NULL
+};
+
+/*
+ * A command to run, with any arguments containing placeholders parsed
+ * up front so that building the arguments for each child is cheap.
+ */
+typedef struct command_t {
+    char **argv;
+    template_t **args;
+    builtin_e builtin;
+} command_t;
+
+/*
+ * A command to run for armour whose label matches the pattern.
+ */
+typedef struct route_t {
+    const char *pattern;
+    command_t cmd;
+} route_t;
+
+/*
+ * The state of a built in command while it consumes one armoured text.
+ */
+typedef struct builtin_t {
+    builtin_e kind;
+    const command_t *cmd;
+    int out;
+    long int lines;
+    long int words;
+    long int bytes;
+    int inword;
+    sha256_t sha;
+    struct timespec start;
+} builtin_t;
+
+/*
+ * Where an armoured text came from: the file given with -f, and the
+ * member within if the file is a tar archive.
+ */
+typedef struct source_t {
+    const char *path;
+    const char *member;
+} source_t;
+
+/*
+ * Armoured texts collected to be passed to a single command.
+ */
+typedef struct batch_t {
+    const command_t *cmd;
+    buffer_t data;
+    long int first;
+    long int last;
+    long int blocks;
+    long long offset;
+    source_t source;
+    char label[MAX_LINE];
+} batch_t;
+
+/*
+ * Armoured texts sharing a label, collected to be passed to a single
+ * command. The armour is held in an anonymous file rather than the heap,
+ * and becomes the stdin of the command as is.
+ */
+typedef struct group_t {
+    const command_t *cmd;
+    int fd;
+    long int first;
+    long int last;
+    long int blocks;
+    long long offset;
+    long long bytes;
+    source_t source;
+    char label[MAX_LINE];
+} group_t;
+
+/*
+ * The state of a single invocation of the command, from the moment the
+ * armour begins until the outcome has been reported.
+ */
+typedef struct child_t {
+    const command_t *cmd;
+    pid_t pid;
+    int file;
+    int in;
+    int out;
+    int err;
+    buffer_t pending;
+    int used;
+    int closed;
+    int exited;
+    int truncated;
+    int cached;
+    int keyed;
+    unsigned char digest[32];
+    long int index;
+    long int last;
+    long int blocks;
+    long long offset;
+    long long length;
+    int status;
+    struct timespec start;
+    struct timespec stop;
+    struct rusage usage;
+    source_t source;
+    char label[MAX_LINE];
+} child_t;
+
+/*
+ * A file to be read, opened ahead of time by the readers.
+ */
+typedef struct input_t {
+    char *path;
+    int fd;
+    int err;
+    int ready;
+    int checked;
+    struct scan_t *scan;
+} input_t;
+
+/*
+ * Options and running totals shared across all armoured blocks.
+ */
+typedef struct xarmour_t {
+    const char *name;
+    const char *command;
+    command_t *cmd;
+    int counting;
+    long int counted;
+    FILE *results;
+    int results_output;
+    int keep_order;
+    int print;
+    int print0;
+    int split_fd;
+    int preallocate;
+    int fsync;
+    template_t split_name;
+    int tag;
+    int capture;
+    int halt;
+    int exit;
+    long int index;
+    long int count;
+    long int times;
+    long int max_blocks;
+    long long max_bytes;
+    int count_blocks;
+    int group_by_label;
+    int memfd;
+    long long last_length;
+    long int pipe_max;
+    long long max_buffered;
+    long long spill_bytes;
+    long long buffered;
+    long long peak_buffered;
+    buffer_t *slabs;
+    long int nslabs;
+    long int slabs_allocated;
+    long int slabs_reused;
+    int stats;
+    group_t *groups;
+    int ngroups;
+    long int jobs;
+    long int running;
+    long int held;
+    long int window;
+    long int next;
+    child_t *children;
+    route_t *routes;
+    int nroutes;
+    matcher_t router;
+    matcher_t include;
+    matcher_t exclude;
+    int ninclude;
+    range_t *ranges;
+    int nranges;
+    long int last;
+    input_t *inputs;
+    long int ninputs;
+    long int ainputs;
+    long int opened;
+    long int scanned;
+    source_t source;
+    int recursive;
+    int failed;
+#ifdef HAVE_DECODE_THREAD
+    atomic_int decode_failed;
+#endif
+    struct tar_t *tar;
+    struct scan_t *scan;
+    struct pool_t *pool;
+    long int scan_threads;
+    int follow;
+    int following;
+    off_t follow_end;
+    int notify;
+    int watched;
+    const char *checkpoint;
+    struct timespec checkpointed;
+    int resume;
+    int resuming;
+    long int resume_input;
+    char *resume_path;
+    char *resume_member;
+    long long resume_offset;
+    struct cache_t *cache;
+    long long cache_ttl;
+    long long cache_size;
+    struct dedup_t *dedup;
+    int dedup_count;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t readers[READERS];
+    int nreaders;
+    int stop;
+#endif
+} xarmour_t;
+
 static int help(const char *name, const char *msg, int code)
 {
     const char *n;
@@ -63,7 +529,16 @@ static int help(const char *name, const char *msg, int code)
             "  %s - Split armoured data and process each one through a command.\n"
             "\n"
             "SYNOPSIS\n"
-            "  %s [-t times] [-v] [-h] [--] command [options]\n"
+            "  %s [-f file] [-r] [--follow] [-t times] [-j jobs] [-k] [--tag] [--results file]\n"
+            "  [--on 'pattern=command'] [--label pattern] [--exclude-label pattern]\n"
+            "  [--index range] [--print] [--print0] [--split-dir dir]\n"
+            "  [--split-name template] [--preallocate] [--fsync] [--max-blocks n]\n"
+            "  [--max-bytes b] [--count-blocks] [--group-by-label] [--memfd]\n"
+            "  [--max-buffered-bytes b] [--spill-bytes b] [--scan-threads n]\n"
+            "  [--checkpoint file] [--resume] [--cache dir] [--cache-ttl s]\n"
+            "  [--cache-size b] [--dedup] [--dedup-count] [--stats] [-v] [-h]\n"
+            "  [--]\n"
+            "  [command [options]]\n"
             "\n"
             "DESCRIPTION\n"
             "\n"
@@ -73,28 +548,217 @@ static int help(const char *name, const char *msg, int code)
             "\n"
             "  All text outside the armoured text block is ignored.\n"
             "\n"
+            "  Different commands can be run depending on the label of the armoured\n"
+            "  text by specifying routes. The command given after the options becomes\n"
+            "  the default route, used when no other route matches. If no route matches\n"
+            "  and there is no default, the armoured text is skipped.\n"
+            "\n"
             "OPTIONS\n"
             "  -f, --file f   Name of file to read containing armoured data. Defaults to\n"
-            "                 stdin.\n"
+            "                 stdin. May be given more than once, in which case the\n"
+            "                 files are read in turn. If f is a directory, the files\n"
+            "                 within are read in name order. If f is '-', stdin is\n"
+            "                 read. Input compressed with gzip, xz or zstd is\n"
+            "                 decompressed as it is read, where supported. A tar\n"
+            "                 archive is read member by member, as if each member\n"
+            "                 were a file of its own.\n"
+            "  -r, --recursive  Read the files within subdirectories of directories\n"
+            "                 given with -f.\n"
+            "  --follow       Once the last input is read to the end, wait for more\n"
+            "                 to be appended to it, as with tail -f. A file that is\n"
+            "                 truncated is read again from the start, and a file\n"
+            "                 replaced by another of the same name, as when a log is\n"
+            "                 rotated, is left for the new one once read to the end.\n"
+            "                 Only plain files are followed.\n"
             "  -t, --times t  Number of times command must be successful for xarmour to\n"
             "                 return success. If unset, xarmour will give up on first\n"
             "                 failure.\n"
+            "  -j, --jobs j   Run up to j commands at the same time. Defaults to 1.\n"
+            "                 When more than one command runs at a time, the stdout\n"
+            "                 and stderr of each command is captured, and passed\n"
+            "                 through as a whole once the command has completed, so\n"
+            "                 that the output of commands is never interleaved.\n"
+            "  -k, --keep-order  Pass through captured output in the order the\n"
+            "                 armoured text appeared in the input, rather than as\n"
+            "                 each command completes. Up to j completed commands are\n"
+            "                 held while waiting for an earlier command to finish.\n"
+            "  --tag          Prefix each line of captured output with the index and\n"
+            "                 label of the armoured text, separated by tabs.\n"
+            "  --on p=c       Run the command c for armoured text with a label matching\n"
+            "                 the pattern p. The pattern is an exact label, a prefix\n"
+            "                 ending in '*', an extended regular expression between\n"
+            "                 slashes, or a shell style glob. An exact match wins\n"
+            "                 over the longest matching prefix, which wins over the\n"
+            "                 first matching glob or regular expression. The command\n"
+            "                 is split into arguments on whitespace, respecting\n"
+            "                 single quotes, double quotes and backslash escapes.\n"
+            "                 May be specified more than once.\n"
+            "  --label p      Only process armoured text with a label matching the\n"
+            "                 pattern p, as described for --on. May be specified\n"
+            "                 more than once.\n"
+            "  --exclude-label p  Skip armoured text with a label matching the\n"
+            "                 pattern p. May be specified more than once.\n"
+            "  --index r      Only process armoured text with an index in the range\n"
+            "                 r, a comma separated list of indexes n, or ranges n-m,\n"
+            "                 n- or -m. May be specified more than once. Reading stops\n"
+            "                 once the last index in the ranges has been passed.\n"
+            "\n"
+            "                 Skipped armoured text is never passed to a command, but\n"
+            "                 is still counted by the index.\n"
+            "  --print        Instead of running a command, write each armoured text\n"
+            "                 that is not skipped to stdout.\n"
+            "  --print0       Like --print, but follow each armoured text with a NUL\n"
+            "                 character, suitable for xargs -0.\n"
+            "  --split-dir d  Instead of running a command, write each armoured text\n"
+            "                 that is not skipped to a file of its own in the existing\n"
+            "                 directory d.\n"
+            "  --split-name t  The template for the name of each file written to the\n"
+            "                 split directory. The placeholders {index}, {label} and\n"
+            "                 {fingerprint} are replaced with the index, the label\n"
+            "                 with unsafe characters replaced by '_', and the SHA-256\n"
+            "                 of the decoded armoured data in hex. Use {{ and }} for\n"
+            "                 literal braces. Defaults to '{index}.pem'.\n"
+            "  --preallocate  Allocate the space for each split file before writing.\n"
+            "  --fsync        Once all split files are written, flush them to disk.\n"
+            "  --max-blocks n  Pass up to n armoured texts to each command, one after\n"
+            "                 the other on stdin. Armoured texts for different routes\n"
+            "                 are never passed to the same command.\n"
+            "  --max-bytes b  Pass up to b bytes of armoured text to each command. An\n"
+            "                 armoured text bigger than b is passed on its own.\n"
+            "  --count-blocks  When passing more than one armoured text to a command,\n"
+            "                 count each armoured text as a success when the command\n"
+            "                 succeeds. By default, each command counts once.\n"
+            "  --group-by-label  Collect the armoured texts with the same label, and\n"
+            "                 pass all of them to a single command once the input has\n"
+            "                 been read, or once --max-blocks or --max-bytes is\n"
+            "                 reached for the label. The armoured texts are held in an\n"
+            "                 anonymous file rather than in memory.\n"
+            "  --memfd        Pass each armoured text to the command as a sealed\n"
+            "                 anonymous file on stdin, rather than through a pipe.\n"
+            "                 The command can seek within the file, read it more than\n"
+            "                 once, or open it by name using {file}.\n"
+            "  --max-buffered-bytes b  Hold back at most b bytes of armour that the\n"
+            "                 commands have not yet read, after which reading of the\n"
+            "                 input pauses until the commands catch up. Defaults to\n"
+            "                 64MB.\n"
+            "  --spill-bytes b  When collecting armoured texts with --split-dir,\n"
+            "                 --max-blocks, --max-bytes, --group-by-label or --memfd,\n"
+            "                 hold an armoured text bigger than b bytes in an anonymous\n"
+            "                 file rather than in memory. Defaults to 16MB.\n"
+            "  --scan-threads n  Search plain files for armoured texts using n\n"
+            "                 threads, each searching part of a file. Threads that\n"
+            "                 run out of work take parts of files from the others,\n"
+            "                 and files opened ahead are searched ahead. The armoured\n"
+            "                 texts are still processed in the order they appear.\n"
+            "  --checkpoint f  Every ten seconds or so, once the commands running\n"
+            "                 have finished, record in the file f the input and the\n"
+            "                 offset within it of the end of the last armoured text\n"
+            "                 processed, along with the index and count so far. The\n"
+            "                 file is replaced as a whole, and is never left half\n"
+            "                 written. Cannot be used with --group-by-label.\n"
+            "  --resume       Pick up from the checkpoint given with --checkpoint,\n"
+            "                 carrying the index and count forward. Plain files are\n"
+            "                 read from the offset recorded, everything else is read\n"
+            "                 up to the offset and thrown away. With no checkpoint\n"
+            "                 yet, start from the beginning.\n"
+            "  --cache dir    Remember in the directory dir each armoured text the\n"
+            "                 command succeeded on, keyed by a digest of the armour,\n"
+            "                 the command line, the label, PATH and the current\n"
+            "                 directory. When the same armour comes round again, it\n"
+            "                 is counted as a success without running the command,\n"
+            "                 and nothing is written to stdout or stderr on its\n"
+            "                 behalf. Each armoured text is collected before the\n"
+            "                 command is run, as with --max-blocks 1, unless\n"
+            "                 --max-blocks or --max-bytes say otherwise, in which\n"
+            "                 case the batch as a whole is remembered. Armour bigger\n"
+            "                 than --spill-bytes and --group-by-label are not cached.\n"
+            "                 Commands using placeholders other than {label} cannot\n"
+            "                 be cached.\n"
+            "  --cache-ttl s  Forget what the command succeeded on after s seconds.\n"
+            "                 Defaults to 7 days.\n"
+            "  --cache-size b  Keep a new cache to b bytes, forgetting the oldest\n"
+            "                 entries first. A cache already made keeps its size.\n"
+            "                 Defaults to 16MB.\n"
+            "  --dedup        Pass each armoured text on to the command only the\n"
+            "                 first time it is seen. Later copies of the same armour\n"
+            "                 are skipped, and are still counted by the index, but\n"
+            "                 not towards the count of successes. Each armoured text\n"
+            "                 is collected before the command is run, as with\n"
+            "                 --cache.\n"
+            "                 Cannot be used with --print, --print0 or --split-dir.\n"
+            "  --dedup-count  As --dedup, but a copy counts as a success if the\n"
+            "                 command succeeded on the first. Cannot be used with\n"
+            "                 --group-by-label.\n"
+            "  --stats        Once complete, report the peak number of bytes held\n"
+            "                 back and the buffers used to hold them on stderr, and\n"
+            "                 with --scan-threads, how many parts of files were taken\n"
+            "                 by a thread from another.\n"
+            "  --results f    Write one JSON object per line to the file f for each\n"
+            "                 armoured text processed, or to stdout if f is '-'. Each\n"
+            "                 object contains the index, label, byte offset and length\n"
+            "                 of the armoured text, the exit status or signal of the\n"
+            "                 command, the wall time, user and system CPU time in\n"
+            "                 seconds, and the maximum resident set size in kilobytes.\n"
+            "                 Bytes outside of ASCII are escaped one by one. When f\n"
+            "                 is '-', each object is written on a line of its own\n"
+            "                 between the output of the commands, which share stdout.\n"
+            "                 Cannot be '-' with --print or --print0.\n"
+            "  --results-output  Capture the stdout and stderr of the command, and\n"
+            "                 include them in the results. The captured output is\n"
+            "                 still passed through once the command has completed.\n"
             "  -h, --help     Display this help message.\n"
             "\n"
             "  -v, --version  Display the version number.\n"
             "\n"
+            "PLACEHOLDERS\n"
+            "  The arguments of a command may contain the following placeholders,\n"
+            "  which are replaced for each command run. Anything else between braces\n"
+            "  is left as is.\n"
+            "\n"
+            "  {index}        Index of the armoured text, as in XARMOUR_INDEX.\n"
+            "  {label}        Label of the armoured text.\n"
+            "  {count}        Command successes so far.\n"
+            "  {offset}       Byte offset of the armoured text in the input.\n"
+            "  {file}         A file name from which the armoured text can be read.\n"
+            "                 With --memfd or --group-by-label the file is seekable.\n"
+            "\n"
+            "BUILT IN COMMANDS\n"
+            "  Commands starting with '@' are reserved, and are implemented within\n"
+            "  xarmour without starting a process. They always succeed, and count\n"
+            "  towards the times option like any other command.\n"
+            "\n"
+            "  @null          Discard the armoured text.\n"
+            "  @cat           Write the armoured text to stdout.\n"
+            "  @count         Print the number of armoured texts once all input is\n"
+            "                 read.\n"
+            "  @wc            Print the lines, words and bytes of each armoured text.\n"
+            "  @sha256        Print the SHA-256 of each armoured text in hex.\n"
+            "\n"
             "ENVIRONMENT\n"
             "  The xarmour tool adds the following environment variables, which can be\n"
             "  used by scripts or for further processing.\n"
             "\n"
-            "  XARMOUR_INDEX  Index of armoured text, starting at zero.\n"
+            "  XARMOUR_INDEX  Index of armoured text, starting at zero. When more than\n"
+            "                 one armoured text is passed to a command, the first and\n"
+            "                 last index separated by a '-'. When grouped by label, the\n"
+            "                 indexes in between may belong to other labels.\n"
+            "  XARMOUR_BLOCKS  Number of armoured texts passed to the command.\n"
             "  XARMOUR_COUNT  Command successes so far.\n"
             "  XARMOUR_TIMES  Times, if set.\n"
-            "  XARMOUR_LABEL  Label of the armoured text.\n"
+            "  XARMOUR_LABEL  Label of the armoured text, or of the first armoured text\n"
+            "                 passed to the command.\n"
+            "  XARMOUR_FILE   Name of the file containing the armoured text, or the\n"
+            "                 first armoured text passed to the command, if given\n"
+            "                 with -f.\n"
+            "  XARMOUR_MEMBER  Name of the tar archive member containing the\n"
+            "                 armoured text, or the first armoured text passed to the\n"
+            "                 command, if read from a tar archive.\n"
             "\n"
             "RETURN VALUE\n"
             "  The xarmour tool returns the return code from the\n"
-            "  first executable to fail.\n"
+            "  first executable to fail. When jobs are run in parallel, no further\n"
+            "  commands are started after a failure, and the commands already running\n"
+            "  are allowed to complete.\n"
             "\n"
             "  If the executable was interrupted with a signal, the return\n"
             "  code is the signal number plus 128.\n"
@@ -118,6 +782,64 @@ static int help(const char *name, const char *msg, int code)
             "\n"
             "\t~$ cat original_file.asc | xarmour -t 2 -- gpg --verify - original_file\n"
             "\n"
+            "  In this example, we verify each certificate in a bundle, and record the\n"
+            "  outcome of each verification as JSON lines.\n"
+            "\n"
+            "\t~$ xarmour -f bundle.pem --results results.json -t 1 -- \\\n"
+            "\t  openssl verify -CAfile ca.pem\n"
+            "\n"
+            "  In this example, we print the subject of each certificate in a bundle\n"
+            "  using four parallel jobs, keeping the output in the original order.\n"
+            "\n"
+            "\t~$ xarmour -f bundle.pem -j 4 -k --tag -- \\\n"
+            "\t  openssl x509 -noout -subject\n"
+            "\n"
+            "  In this example, we dump certificates and revocation lists found in a\n"
+            "  bundle in a single pass, ignoring everything else.\n"
+            "\n"
+            "\t~$ xarmour -f bundle.pem \\\n"
+            "\t  --on 'CERTIFICATE=openssl x509 -noout -text' \\\n"
+            "\t  --on 'X509 CRL=openssl crl -noout -text'\n"
+            "\n"
+            "  In this example, we print the second and third certificates in a\n"
+            "  bundle, skipping any private keys without starting a command for them.\n"
+            "\n"
+            "\t~$ xarmour -f bundle.pem --exclude-label '*PRIVATE KEY' \\\n"
+            "\t  --index 1-2 -- openssl x509 -noout -text\n"
+            "\n"
+            "  In this example, we extract the certificates from a file containing\n"
+            "  keys and certificates, without starting a command for each one.\n"
+            "\n"
+            "\t~$ xarmour -f server.pem --label CERTIFICATE --print > chain.pem\n"
+            "\n"
+            "  In this example, we archive each certificate in a bundle to a file\n"
+            "  named after its fingerprint.\n"
+            "\n"
+            "\t~$ xarmour -f bundle.pem --label CERTIFICATE --split-dir out \\\n"
+            "\t  --split-name '{fingerprint}.pem'\n"
+            "\n"
+            "  In this example, we measure how fast armoured text can be scanned,\n"
+            "  without the cost of starting any commands.\n"
+            "\n"
+            "\t~$ time xarmour -f bundle.pem -- @null\n"
+            "\n"
+            "  In this example, we bundle certificates a hundred at a time into PKCS7\n"
+            "  structures, starting one openssl command for each hundred.\n"
+            "\n"
+            "\t~$ xarmour -f bundle.pem --label CERTIFICATE --max-blocks 100 -- \\\n"
+            "\t  openssl crl2pkcs7 -nocrl -certfile /dev/stdin\n"
+            "\n"
+            "  In this example, we count the armoured texts of each kind in a file,\n"
+            "  starting one command per label.\n"
+            "\n"
+            "\t~$ xarmour -f bundle.pem --group-by-label -- \\\n"
+            "\t  sh -c 'echo $XARMOUR_LABEL: $XARMOUR_BLOCKS'\n"
+            "\n"
+            "  In this example, we save each certificate to a file named after its\n"
+            "  index, without needing a shell.\n"
+            "\n"
+            "\t~$ xarmour -f bundle.pem -- openssl x509 -out cert-{index}.pem\n"
+            "\n"
             "AUTHOR\n"
             "  Graham Leggett <minfrin@sharp.fm>\n"
             "", msg ? msg : "", n, n);
@@ -130,230 +852,6589 @@ static int version()
     return 0;
 }
 
-int main (int argc, char **argv)
+/*
+ * Write the whole buffer, retrying on short writes and interrupts.
+ */
+static int write_all(int fd, const char *buf, size_t len)
 {
-    int pipefd[2];
-    char buffer[MAX_LINE];
-    char blabel[MAX_LINE];
-    char elabel[MAX_LINE];
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
 
-    const char *begin = "-----BEGIN %1000[^-]-----";
-    const char *end = "-----END %1000[^-]-----";
+    return 0;
+}
 
-    const char *file = NULL;
-    FILE *in = stdin;
+/*
+ * Create an anonymous file to capture the output of a child. We prefer
+ * a memfd, falling back to an unlinked temporary file.
+ */
+static int capture_open(const char *name)
+{
+    int fd;
 
-    const char *name = argv[0];
-    long int index = 0, count = 0, times = 0;
-    int c, status = 0;
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
 
-    pid_t f = -1, w;
+    {
+        char path[PATH_MAX];
+        const char *tmpdir = getenv("TMPDIR");
 
-    while ((c = getopt_long(argc, argv, "f:t:hv", long_options, NULL)) != -1) {
+        snprintf(path, sizeof(path), "%s/xarmour.XXXXXX",
+                tmpdir && *tmpdir ? tmpdir : "/tmp");
 
-        switch (c)
-        {
-        case 'f':
-            in = fopen(optarg, "r");
+        fd = mkstemp(path);
+        if (fd >= 0) {
+            unlink(path);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
 
-            if (!in) {
-                fprintf(stderr, "%s: Could not open '%s': %s", name, optarg,
-                        strerror(errno));
+    return fd;
+}
 
-                return EXIT_FAILURE;
+/*
+ * Seal an anonymous file once fully written, so that the commands reading
+ * it can rely on the contents not changing underneath them. Files that
+ * cannot be sealed, such as our temporary file fallback, are left as is.
+ */
+static void capture_seal(int fd)
+{
+#ifdef F_ADD_SEALS
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE
+            | F_SEAL_SEAL);
+#else
+    (void)fd;
+#endif
+}
+
+/*
+ * Copy the captured output from the start of the file to the given
+ * descriptor, optionally prefixing each line.
+ */
+static void capture_copy(int fd, int to, const char *prefix)
+{
+    char buf[16384];
+    ssize_t n;
+    int bol = 1;
+
+    if (fd < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        return;
+    }
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        char *b = buf, *e = buf + (n > 0 ? n : 0);
+
+        if (!prefix) {
+            if (write_all(to, b, e - b)) {
+                return;
             }
+            continue;
+        }
 
-            break;
-        case 't':
-            times = strtol(optarg, &optarg, 10);
+        while (b < e) {
+            char *nl = memchr(b, '\n', e - b);
+            char *l = nl ? nl + 1 : e;
 
-            if (errno || optarg[0] || times < 1) {
-                return help(name, "Count must be bigger than 0.\n", EXIT_FAILURE);
+            if (bol && write_all(to, prefix, strlen(prefix))) {
+                return;
+            }
+            if (write_all(to, b, l - b)) {
+                return;
             }
 
-            break;
-        case 'h':
-            return help(name, NULL, 0);
+            bol = (nl != NULL);
+            b = l;
+        }
+    }
+}
 
-        case 'v':
-            return version();
+static void json_escape(FILE *out, const char *str, size_t len)
+{
+    size_t i;
 
-        default:
-            return help(name, NULL, EXIT_FAILURE);
+    for (i = 0; i < len; i++) {
+        unsigned char ch = str[i];
 
+        switch (ch) {
+        case '"':
+            fputs("\\\"", out);
+            break;
+        case '\\':
+            fputs("\\\\", out);
+            break;
+        case '\n':
+            fputs("\\n", out);
+            break;
+        case '\r':
+            fputs("\\r", out);
+            break;
+        case '\t':
+            fputs("\\t", out);
+            break;
+        default:
+            /* bytes that may not be valid UTF-8 are escaped too */
+            if (ch < 0x20 || ch >= 0x7f) {
+                fprintf(out, "\\u%04x", ch);
+            }
+            else {
+                fputc(ch, out);
+            }
         }
+    }
+}
 
+static void json_string(FILE *out, const char *str, size_t len)
+{
+    fputc('"', out);
+    json_escape(out, str, len);
+    fputc('"', out);
+}
+
+/*
+ * Write the captured output as a JSON string.
+ */
+static void json_capture(FILE *out, int fd)
+{
+    char buf[16384];
+    ssize_t n;
+
+    if (fd < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        fputs("null", out);
+        return;
     }
 
-    if (optind == argc) {
-        fprintf(stderr, "%s: No command specified.\n", name);
-        return EXIT_FAILURE;
+    fputc('"', out);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) {
+            json_escape(out, buf, n);
+        }
     }
 
-    while (fgets(buffer, sizeof(buffer), in)) {
+    fputc('"', out);
+}
 
-        if (f < 0) {
+static double timespec_diff(const struct timespec *start,
+        const struct timespec *stop)
+{
+    return (double)(stop->tv_sec - start->tv_sec)
+            + (double)(stop->tv_nsec - start->tv_nsec) / 1e9;
+}
 
-            /* we are seeking the start of the armour */
+static double timeval_seconds(const struct timeval *tv)
+{
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
 
-            if (sscanf(buffer, begin, blabel) == 1) {
+/*
+ * Record the outcome of a child as a single JSON object per line.
+ */
+static void results_write(xarmour_t *xa, child_t *child)
+{
+    FILE *out = xa->results;
 
-                /* start up the command */
+    if (!out) {
+        return;
+    }
 
-                if (pipe(pipefd)) {
-                    fprintf(stderr, "%s: Could not create pipe: %s", name,
-                            strerror(errno));
+    fprintf(out, "{\"index\":%ld,\"label\":", child->index);
+    json_string(out, child->label, strlen(child->label));
+    if (child->source.path) {
+        fputs(",\"file\":", out);
+        json_string(out, child->source.path, strlen(child->source.path));
+    }
+    if (child->source.member) {
+        fputs(",\"member\":", out);
+        json_string(out, child->source.member, strlen(child->source.member));
+    }
+    fprintf(out, ",\"offset\":%lld,\"length\":%lld", child->offset,
+            child->length);
 
-                    return EXIT_FAILURE;
-                }
+    if (child->blocks > 1) {
+        fprintf(out, ",\"last\":%ld,\"blocks\":%ld", child->last,
+                child->blocks);
+    }
 
-                /* Clear any inherited settings */
-                signal(SIGCHLD, SIG_DFL);
+    if (child->cached) {
+        fputs(",\"cached\":true", out);
+    }
 
-                f = fork();
+    if (WIFEXITED(child->status)) {
+        fprintf(out, ",\"exit\":%d", WEXITSTATUS(child->status));
+    }
+    else if (WIFSIGNALED(child->status)) {
+        fprintf(out, ",\"signal\":%d", WTERMSIG(child->status));
+    }
 
-                /* error */
-                if (f < 0) {
-                    fprintf(stderr, "%s: Could not fork: %s", name,
-                            strerror(errno));
+    fprintf(out, ",\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss\":%ld",
+            timespec_diff(&child->start, &child->stop),
+            timeval_seconds(&child->usage.ru_utime),
+            timeval_seconds(&child->usage.ru_stime),
+            child->usage.ru_maxrss);
 
-                    return EXIT_FAILURE;
-                }
+    if (xa->results_output) {
+        fputs(",\"stdout\":", out);
+        json_capture(out, child->out);
+        fputs(",\"stderr\":", out);
+        json_capture(out, child->err);
+    }
 
-                /* child */
-                else if (f == 0) {
+    fputs("}\n", out);
+    fflush(out);
+}
 
-                    char buf[128];
 
-                    snprintf(buf, sizeof(buf), "%ld", index);
-                    setenv("XARMOUR_INDEX", buf, 1);
+static int matcher_node(matcher_t *m, int parent, unsigned char ch)
+{
+    int n;
 
-                    snprintf(buf, sizeof(buf), "%ld", count);
-                    setenv("XARMOUR_COUNT", buf, 1);
+    for (n = m->nnodes ? m->nodes[parent].next : 0; n; n = m->nodes[n].sibling) {
+        if (m->nodes[n].ch == ch) {
+            return n;
+        }
+    }
 
-                    snprintf(buf, sizeof(buf), "%ld", times);
-                    setenv("XARMOUR_TIMES", buf, 1);
+    if (m->nnodes == m->anodes) {
+        int anodes = m->anodes ? m->anodes * 2 : 64;
+        match_node_t *nodes = realloc(m->nodes, anodes * sizeof(match_node_t));
 
-                    setenv("XARMOUR_LABEL", blabel, 1);
+        if (!nodes) {
+            return -1;
+        }
 
-                    close(pipefd[WRITE_FD]);
-                    dup2(pipefd[READ_FD], STDIN_FILENO);
-                    close(pipefd[READ_FD]);
+        m->nodes = nodes;
+        m->anodes = anodes;
+    }
 
-                    execvp(argv[optind], argv + optind);
+    n = m->nnodes++;
 
-                    fprintf(stderr, "%s: Could not execute '%s', giving up: %s\n", name,
-                            argv[optind], strerror(errno));
+    m->nodes[n].ch = ch;
+    m->nodes[n].next = 0;
+    m->nodes[n].exact = -1;
+    m->nodes[n].prefix = -1;
+    m->nodes[n].sibling = 0;
 
-                    return EXIT_FAILURE;
-                }
+    /* the root has no parent */
+    if (n) {
+        m->nodes[n].sibling = m->nodes[parent].next;
+        m->nodes[parent].next = n;
+    }
 
-                /* parent */
-                else {
+    return n;
+}
 
-                    close(pipefd[READ_FD]);
+/*
+ * Add a pattern to the matcher. A pattern without glob characters is an
+ * exact match, a pattern whose only glob character is a trailing '*' is
+ * a prefix match, a pattern between slashes is an extended regular
+ * expression, and anything else is matched with fnmatch(). If the same
+ * pattern is added twice, the first one wins.
+ *
+ * Returns -1 if out of memory, or 1 if the regular expression is invalid.
+ */
+static int matcher_add(matcher_t *m, const char *pattern, int value)
+{
+    size_t len = strlen(pattern);
+    size_t meta = strcspn(pattern, "*?[\\");
+    int prefix = 0, node = 0;
+    size_t i;
 
-                }
+    if (!m->nnodes && matcher_node(m, 0, 0) < 0) {
+        return -1;
+    }
 
-            }
+    if (len > 1 && pattern[0] == '/' && pattern[len - 1] == '/') {
+        match_pattern_t *patterns, *p;
+        char *re;
 
+        patterns = realloc(m->patterns, (m->npatterns + 1) * sizeof(match_pattern_t));
+        if (!patterns) {
+            return -1;
         }
+        m->patterns = patterns;
+        p = &patterns[m->npatterns];
 
-        if (f >= 0) {
+        p->glob = NULL;
+        p->value = value;
+        p->re = malloc(sizeof(regex_t));
+        re = strndup(pattern + 1, len - 2);
+        if (!p->re || !re) {
+            free(p->re);
+            free(re);
+            return -1;
+        }
 
-            /* write the armour */
+        if (regcomp(p->re, re, REG_EXTENDED | REG_NOSUB)) {
+            free(p->re);
+            free(re);
+            return 1;
+        }
 
-            if (write(pipefd[WRITE_FD], buffer, strlen(buffer)) < 0) {
-                /* ignore write failures, we'll hear about it below */
-            }
+        free(re);
+        m->npatterns++;
 
-            /* we are seeking the end of the armour */
+        return 0;
+    }
+    else if (meta == len - 1 && pattern[meta] == '*') {
+        prefix = 1;
+        len--;
+    }
+    else if (meta < len) {
+        match_pattern_t *patterns;
 
-            if (sscanf(buffer, end, elabel) == 1 && !strcmp(blabel, elabel)) {
+        patterns = realloc(m->patterns, (m->npatterns + 1) * sizeof(match_pattern_t));
+        if (!patterns) {
+            return -1;
+        }
+        m->patterns = patterns;
 
-                index++;
+        patterns[m->npatterns].glob = pattern;
+        patterns[m->npatterns].re = NULL;
+        patterns[m->npatterns].value = value;
+        m->npatterns++;
 
-                close(pipefd[WRITE_FD]);
+        return 0;
+    }
 
-                /* wait for the child process to be done */
-                do {
-                    w = waitpid(f, &status, 0);
-                    if (w == -1 && errno != EINTR) {
-                        break;
-                    }
-                } while (w != f);
+    for (i = 0; i < len; i++) {
+        node = matcher_node(m, node, pattern[i]);
+        if (node < 0) {
+            return -1;
+        }
+    }
 
-                /* waitpid failed, we give up */
-                if (w == -1) {
+    if (prefix && m->nodes[node].prefix < 0) {
+        m->nodes[node].prefix = value;
+    }
+    else if (!prefix && m->nodes[node].exact < 0) {
+        m->nodes[node].exact = value;
+    }
 
-                    fprintf(stderr, "%s: waitpid for '%s' failed: %s\n", name,
-                            argv[optind], strerror(errno));
+    return 0;
+}
 
-                    return EXIT_FAILURE;
-                }
+/*
+ * Match the label, returning the value of the best matching pattern, or
+ * -1 if nothing matched.
+ */
+static int matcher_match(const matcher_t *m, const char *label)
+{
+    const unsigned char *l = (const unsigned char *)label;
+    int node = 0, best = -1, i;
 
-                /* process successful exit */
-                else if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+    if (!m->nnodes && !m->npatterns) {
+        return -1;
+    }
 
-                    /* drop through */
-                    count++;
-                }
+    while (m->nnodes) {
 
-                /* must we ignore failures? */
-                else if (times) {
+        if (m->nodes[node].prefix >= 0) {
+            best = m->nodes[node].prefix;
+        }
 
-                    /* drop through */
-                }
+        if (!*l) {
+            if (m->nodes[node].exact >= 0) {
+                return m->nodes[node].exact;
+            }
+            break;
+        }
 
-                /* process non success exit */
-                else if (WIFEXITED(status)) {
+        for (node = m->nodes[node].next; node; node = m->nodes[node].sibling) {
+            if (m->nodes[node].ch == *l) {
+                break;
+            }
+        }
 
-                    fprintf(stderr, "%s: %s returned %d\n", name,
-                            argv[optind], status);
+        if (!node) {
+            break;
+        }
 
-                    return WEXITSTATUS(status);
-                }
+        l++;
+    }
 
-                /* process received a signal */
-                else if (WIFSIGNALED(status)) {
+    if (best >= 0) {
+        return best;
+    }
 
-                    fprintf(stderr, "%s: %s signaled %d\n", name,
-                            argv[optind], status);
+    for (i = 0; i < m->npatterns; i++) {
+        const match_pattern_t *p = &m->patterns[i];
 
-                    return WTERMSIG(status) + 128;
-                }
+        if (p->glob ? !fnmatch(p->glob, label, 0)
+                : !regexec(p->re, label, 0, NULL, 0)) {
+            return p->value;
+        }
+    }
 
-                /* otherwise weirdness, just leave */
-                else {
+    return -1;
+}
+
+/*
+ * Add a pattern given on the command line, complaining if it is invalid.
+ */
+static int pattern_add(const char *name, matcher_t *m, const char *pattern,
+        int value)
+{
+    int rv = matcher_add(m, pattern, value);
 
-                    fprintf(stderr, "%s: %s failed with %d\n", name,
-                            argv[optind], status);
+    if (rv < 0) {
+        fprintf(stderr, "%s: Out of memory\n", name);
+        return EXIT_FAILURE;
+    }
+    else if (rv) {
+        fprintf(stderr, "%s: Pattern '%s' is not a valid regular expression\n",
+                name, pattern);
+        return EXIT_FAILURE;
+    }
 
-                    return EX_OSERR;
-                }
+    return 0;
+}
 
-                f = -1;
+/*
+ * Parse a comma separated list of index ranges, each of which is n, n-m,
+ * n- or -m.
+ */
+static int ranges_parse(xarmour_t *xa, char *arg)
+{
+    char *tok, *last = NULL;
+
+    for (tok = strtok_r(arg, ",", &last); tok; tok = strtok_r(NULL, ",", &last)) {
+        range_t *ranges, r;
+        char *dash = strchr(tok, '-');
+
+        errno = 0;
 
+        if (dash) {
+            r.from = dash == tok ? 0 : strtol(tok, &tok, 10);
+            if (errno || tok != dash) {
+                return -1;
+            }
+            r.to = dash[1] ? strtol(dash + 1, &tok, 10) : -1;
+            if (errno || (dash[1] && (tok[0] || r.to < r.from))) {
+                return -1;
+            }
+        }
+        else {
+            r.from = r.to = strtol(tok, &tok, 10);
+            if (errno || tok[0]) {
+                return -1;
             }
+        }
 
+        if (r.from < 0) {
+            return -1;
+        }
 
+        ranges = realloc(xa->ranges, (xa->nranges + 1) * sizeof(range_t));
+        if (!ranges) {
+            return -1;
         }
+        xa->ranges = ranges;
+        xa->ranges[xa->nranges++] = r;
 
+        /* remember the last index we could ever want */
+        if (xa->last >= 0) {
+            xa->last = r.to < 0 ? -1 : r.to > xa->last ? r.to : xa->last;
+        }
     }
 
-    if (times) {
-        if (count < times) {
-            fprintf(stderr, "%s: %s: %ld success%s, %ld required: failed\n", name,
-                    argv[optind], count, count == 1 ? "" : "es", times);
-            return EXIT_FAILURE;
+    return 0;
+}
+
+/*
+ * Do we want the armour with the given label at the current index? This
+ * is decided before any pipe or child is created.
+ */
+static int armour_wanted(const xarmour_t *xa, const char *label)
+{
+    int i;
+
+    if (xa->nranges) {
+        for (i = 0; i < xa->nranges; i++) {
+            if (xa->index >= xa->ranges[i].from
+                    && (xa->ranges[i].to < 0 || xa->index <= xa->ranges[i].to)) {
+                break;
+            }
         }
-        else {
-            fprintf(stderr, "%s: %s: %ld success%s, %ld required: success\n", name,
-                    argv[optind], count, count == 1 ? "" : "es", times);
-            return EXIT_SUCCESS;
+        if (i == xa->nranges) {
+            return 0;
         }
     }
 
-    return EXIT_SUCCESS;
+    if (xa->ninclude && matcher_match(&xa->include, label) < 0) {
+        return 0;
+    }
+
+    if (matcher_match(&xa->exclude, label) >= 0) {
+        return 0;
+    }
+
+    return 1;
 }
 
+/*
+ * Split a command line into a NULL terminated argument vector, honouring
+ * single quotes, double quotes and backslash escapes like the shell does.
+ * Returns NULL on an unterminated quote or out of memory.
+ */
+static char **args_split(const char *str)
+{
+    char **args = NULL, *arg, *a;
+    size_t nargs = 0;
+    char quote;
+
+    /* no argument can be longer than the string itself */
+    arg = malloc(strlen(str) + 1);
+    if (!arg) {
+        return NULL;
+    }
+
+    for (;;) {
+        char **nargv;
+        int found = 0;
+
+        while (*str == ' ' || *str == '\t' || *str == '\n') {
+            str++;
+        }
+
+        a = arg;
+        quote = 0;
+
+        while (*str && (quote || (*str != ' ' && *str != '\t' && *str != '\n'))) {
+            found = 1;
+
+            if (quote && *str == quote) {
+                quote = 0;
+            }
+            else if (!quote && (*str == '\'' || *str == '"')) {
+                quote = *str;
+            }
+            else if (*str == '\\' && quote != '\'' && str[1]) {
+                *a++ = *++str;
+            }
+            else {
+                *a++ = *str;
+            }
+
+            str++;
+        }
+
+        if (quote) {
+            break;
+        }
+
+        nargv = realloc(args, (nargs + 2) * sizeof(char *));
+        if (!nargv) {
+            break;
+        }
+        args = nargv;
+        args[nargs] = NULL;
+
+        if (!found) {
+            free(arg);
+            return args;
+        }
+
+        *a = 0;
+        args[nargs] = strdup(arg);
+        if (!args[nargs]) {
+            break;
+        }
+        args[++nargs] = NULL;
+    }
+
+    while (nargs--) {
+        free(args[nargs]);
+    }
+    free(args);
+    free(arg);
+
+    return NULL;
+}
+
+static int buffer_append(buffer_t *b, const char *data, size_t len)
+{
+    if (b->len + len > b->size) {
+        size_t size = b->size ? b->size : 4096;
+        char *d;
+
+        while (size < b->len + len) {
+            size *= 2;
+        }
+
+        d = realloc(b->data, size);
+        if (!d) {
+            return -1;
+        }
+
+        b->data = d;
+        b->size = size;
+    }
+
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+
+    return 0;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_init(sha256_t *s)
+{
+    static const uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(s->h, h, sizeof(h));
+    s->len = 0;
+    s->used = 0;
+}
+
+static void sha256_block(sha256_t *s, const unsigned char *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16
+                | (uint32_t)p[i * 4 + 2] << 8 | (uint32_t)p[i * 4 + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+    e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25))
+                + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22))
+                + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256_update(sha256_t *s, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    s->len += len;
+
+    if (s->used) {
+        size_t n = 64 - s->used < len ? 64 - s->used : len;
+
+        memcpy(s->block + s->used, p, n);
+        s->used += n;
+        p += n;
+        len -= n;
+
+        if (s->used < 64) {
+            return;
+        }
+
+        sha256_block(s, s->block);
+        s->used = 0;
+    }
+
+    while (len >= 64) {
+        sha256_block(s, p);
+        p += 64;
+        len -= 64;
+    }
+
+    memcpy(s->block, p, len);
+    s->used = len;
+}
+
+static void sha256_final(sha256_t *s, unsigned char digest[32])
+{
+    uint64_t bits = s->len * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t n = (s->used < 56 ? 56 : 120) - s->used;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        pad[n + i] = bits >> (56 - i * 8);
+    }
+
+    sha256_update(s, pad, n + 8);
+
+    for (i = 0; i < 8; i++) {
+        digest[i * 4] = s->h[i] >> 24;
+        digest[i * 4 + 1] = s->h[i] >> 16;
+        digest[i * 4 + 2] = s->h[i] >> 8;
+        digest[i * 4 + 3] = s->h[i];
+    }
+}
+
+static void hex_encode(const unsigned char *data, size_t len, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hex[i * 2] = digits[data[i] >> 4];
+        hex[i * 2 + 1] = digits[data[i] & 0xf];
+    }
+    hex[len * 2] = 0;
+}
+
+/*
+ * Calculate the SHA-256 fingerprint of the data within the armour, as
+ * "openssl x509 -fingerprint -sha256" would. Header lines, blank lines and
+ * the PGP checksum are skipped, and the remaining base64 is decoded.
+ */
+static void armour_fingerprint(const char *data, size_t len, char *hex)
+{
+    const char *end = data + len, *line, *eol;
+    unsigned char digest[32], out[3];
+    unsigned int acc = 0;
+    int bits = 0, first = 1;
+    sha256_t s;
+
+    sha256_init(&s);
+
+    for (line = data; line < end; line = eol + 1) {
+        const char *c;
+
+        eol = memchr(line, '\n', end - line);
+        if (!eol) {
+            eol = end;
+        }
+
+        /* the BEGIN and END lines, headers, and the PGP checksum */
+        if (first || !strncmp(line, "-----", 5) || memchr(line, ':', eol - line)
+                || (line[0] == '=' && eol - line <= 6)) {
+            first = 0;
+            continue;
+        }
+
+        for (c = line; c < eol; c++) {
+            int v;
+
+            if (*c >= 'A' && *c <= 'Z') {
+                v = *c - 'A';
+            }
+            else if (*c >= 'a' && *c <= 'z') {
+                v = *c - 'a' + 26;
+            }
+            else if (*c >= '0' && *c <= '9') {
+                v = *c - '0' + 52;
+            }
+            else if (*c == '+') {
+                v = 62;
+            }
+            else if (*c == '/') {
+                v = 63;
+            }
+            else {
+                continue;
+            }
+
+            acc = (acc << 6) | v;
+            bits += 6;
+
+            if (bits >= 8) {
+                bits -= 8;
+                out[0] = acc >> bits;
+                sha256_update(&s, out, 1);
+            }
+        }
+    }
+
+    sha256_final(&s, digest);
+    hex_encode(digest, sizeof(digest), hex);
+}
+
+/*
+ * Parse a template containing placeholders between braces, allowing only
+ * the given kinds of placeholder.
+ *
+ * A strict template rejects anything else between braces, and a literal
+ * brace is written as a double brace. Otherwise anything that is not an
+ * allowed placeholder is left as is, so that commands containing braces
+ * of their own keep working.
+ */
+static int template_parse(template_t *t, const char *str, unsigned int allowed,
+        int strict)
+{
+    static const struct {
+        const char *name;
+        template_e kind;
+    } names[] = {
+        {"index", TPL_INDEX},
+        {"label", TPL_LABEL},
+        {"fingerprint", TPL_FINGERPRINT},
+        {"count", TPL_COUNT},
+        {"offset", TPL_OFFSET},
+        {"file", TPL_FILE},
+        {NULL, TPL_LITERAL}
+    };
+
+    buffer_t lit = { 0 };
+
+    memset(t, 0, sizeof(template_t));
+
+    while (*str || lit.len) {
+        template_e kind = TPL_LITERAL;
+        template_e *kinds;
+        char **literals;
+
+        if (strict && *str == '{' && str[1] == '{') {
+            buffer_append(&lit, str, 1);
+            str += 2;
+            continue;
+        }
+        else if (strict && *str == '}' && str[1] == '}') {
+            buffer_append(&lit, str, 1);
+            str += 2;
+            continue;
+        }
+        else if (*str == '{') {
+            const char *close = strchr(str, '}');
+            int i = 0;
+
+            if (close) {
+                for (i = 0; names[i].name; i++) {
+                    if (strlen(names[i].name) == (size_t)(close - str - 1)
+                            && !strncmp(names[i].name, str + 1, close - str - 1)
+                            && (allowed & (1 << names[i].kind))) {
+                        break;
+                    }
+                }
+            }
+
+            if (!close || !names[i].name) {
+                if (strict) {
+                    free(lit.data);
+                    return -1;
+                }
+                buffer_append(&lit, str++, 1);
+                continue;
+            }
+
+            /* flush any literal text first */
+            if (!lit.len) {
+                kind = names[i].kind;
+                str = close + 1;
+            }
+        }
+        else if (*str) {
+            buffer_append(&lit, str++, 1);
+            continue;
+        }
+
+        kinds = realloc(t->kinds, (t->nparts + 1) * sizeof(template_e));
+        literals = realloc(t->literals, (t->nparts + 1) * sizeof(char *));
+        if (!kinds || !literals) {
+            free(lit.data);
+            return -1;
+        }
+        t->kinds = kinds;
+        t->literals = literals;
+
+        t->kinds[t->nparts] = kind;
+        t->literals[t->nparts] = NULL;
+
+        if (kind == TPL_LITERAL) {
+            t->literals[t->nparts] = strndup(lit.data, lit.len);
+            lit.len = 0;
+        }
+
+        t->nparts++;
+    }
+
+    free(lit.data);
+
+    return 0;
+}
+
+/*
+ * Does the template use the given placeholder?
+ */
+static int template_uses(const template_t *t, template_e kind)
+{
+    int i;
+
+    for (i = 0; i < t->nparts; i++) {
+        if (t->kinds[i] == kind) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * How big could the template be once expanded?
+ */
+static size_t template_size(const template_t *t)
+{
+    size_t size = 1;
+    int i;
+
+    for (i = 0; i < t->nparts; i++) {
+        size += t->kinds[i] == TPL_LITERAL ? strlen(t->literals[i])
+                : MAX_LINE + 64;
+    }
+
+    return size;
+}
+
+/*
+ * Expand the template, truncating at the given size. When safe is set,
+ * the label is made safe to use as a file name.
+ */
+static void template_expand(const template_t *t, char *buf, size_t size,
+        const template_vars_t *v, int safe)
+{
+    size_t len = 0;
+    int i;
+
+    buf[0] = 0;
+
+    for (i = 0; i < t->nparts && len < size; i++) {
+        int n = 0;
+
+        switch (t->kinds[i]) {
+        case TPL_LITERAL:
+            n = snprintf(buf + len, size - len, "%s", t->literals[i]);
+            break;
+        case TPL_INDEX:
+            n = snprintf(buf + len, size - len, "%s", v->index);
+            break;
+        case TPL_LABEL: {
+            const char *l;
+
+            if (!safe) {
+                n = snprintf(buf + len, size - len, "%s", v->label);
+                break;
+            }
+
+            for (l = v->label; *l && len + n + 1 < size; l++) {
+                buf[len + n++] = (isalnum((unsigned char)*l) || *l == '.'
+                        || *l == '-') ? *l : '_';
+            }
+            buf[len + n] = 0;
+
+            break;
+        }
+        case TPL_FINGERPRINT:
+            n = snprintf(buf + len, size - len, "%s", v->fingerprint);
+            break;
+        case TPL_COUNT:
+            n = snprintf(buf + len, size - len, "%ld", v->count);
+            break;
+        case TPL_OFFSET:
+            n = snprintf(buf + len, size - len, "%lld", v->offset);
+            break;
+        case TPL_FILE:
+            n = snprintf(buf + len, size - len, "%s", v->file);
+            break;
+        }
+
+        if (n < 0) {
+            break;
+        }
+
+        len += n;
+    }
+}
+
+/*
+ * Move armour collected so far into an anonymous file, so that the rest
+ * of an oversized armoured text need not be held in memory.
+ */
+static int spill_open(xarmour_t *xa, int *spill, buffer_t *block)
+{
+    *spill = capture_open("xarmour-spill");
+
+    if (*spill < 0 || write_all(*spill, block->data, block->len)) {
+        fprintf(stderr, "%s: Could not spill armour: %s\n", xa->name,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    block->len = 0;
+
+    return 0;
+}
+
+static long long spill_size(int spill)
+{
+    struct stat st;
+
+    if (fstat(spill, &st)) {
+        return 0;
+    }
+
+    return st.st_size;
+}
+
+/*
+ * Copy spilled armour to the given descriptor, within the kernel where
+ * we can.
+ */
+static int spill_copy(int spill, int to)
+{
+    char buf[16384];
+    off_t off = 0;
+    long long size = spill_size(spill);
+    ssize_t n;
+
+#ifdef HAVE_SENDFILE
+    while (off < size) {
+        n = sendfile(to, spill, &off, size - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+    }
+#endif
+
+    if (lseek(spill, off, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    /* no sendfile, or not to this descriptor */
+    while (off < size) {
+        n = read(spill, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || write_all(to, buf, n)) {
+            return -1;
+        }
+        off += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the armour to a file of its own in the split directory. Spilled
+ * armour is taken from the spill file instead.
+ */
+static int split_write(xarmour_t *xa, const char *label, const buffer_t *block,
+        int spill)
+{
+    char name[PATH_MAX];
+    char fingerprint[65] = "";
+    long long len = spill >= 0 ? spill_size(spill) : (long long)block->len;
+    int fd;
+
+    char index[32];
+    template_vars_t vars = { 0 };
+
+    if (!template_uses(&xa->split_name, TPL_FINGERPRINT)) {
+        /* no fingerprint needed */
+    }
+    else if (spill < 0) {
+        armour_fingerprint(block->data, block->len, fingerprint);
+    }
+    else if (len) {
+        void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, spill, 0);
+
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "%s: Could not map spilled armour: %s\n",
+                    xa->name, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        armour_fingerprint(map, len, fingerprint);
+        munmap(map, len);
+    }
+
+    snprintf(index, sizeof(index), "%ld", xa->index);
+
+    vars.index = index;
+    vars.label = label;
+    vars.fingerprint = fingerprint;
+
+    template_expand(&xa->split_name, name, sizeof(name), &vars, 1);
+
+    fd = openat(xa->split_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0666);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Could not create '%s': %s\n", xa->name, name,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+#ifdef HAVE_POSIX_FALLOCATE
+    if (xa->preallocate && len) {
+        /* best effort, the write below is what matters */
+        posix_fallocate(fd, 0, len);
+    }
+#endif
+
+    if ((spill >= 0 ? spill_copy(spill, fd)
+            : write_all(fd, block->data, block->len)) || close(fd)) {
+        fprintf(stderr, "%s: Could not write '%s': %s\n", xa->name, name,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
+
+/*
+ * Flush everything written to the split directory to disk in one go.
+ */
+static int split_sync(xarmour_t *xa)
+{
+#ifdef HAVE_SYNCFS
+    if (syncfs(xa->split_fd)) {
+        fprintf(stderr, "%s: Could not sync: %s\n", xa->name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+#else
+    sync();
+#endif
+
+    if (fsync(xa->split_fd) && errno != EINVAL) {
+        fprintf(stderr, "%s: Could not sync: %s\n", xa->name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
+
+/*
+ * Keep where armour came from for as long as it is needed. The name of
+ * the archive member is replaced as the archive is read, so the copy
+ * has a name of its own, to be freed with source_free().
+ */
+static int source_copy(source_t *to, const source_t *from)
+{
+    to->path = from->path;
+    to->member = NULL;
+
+    if (from->member && !(to->member = strdup(from->member))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void source_free(source_t *s)
+{
+    free((char *)s->member);
+    s->member = NULL;
+}
+
+/*
+ * Record the outcome of armour handled without a command, which always
+ * succeeds. The wall time is measured from start, if given.
+ */
+static void results_print(xarmour_t *xa, const char *label, long long offset,
+        long long length, const struct timespec *start)
+{
+    child_t printed = { 0 };
+
+    if (!xa->results) {
+        return;
+    }
+
+    printed.index = xa->index;
+    printed.source = xa->source;
+    printed.offset = offset;
+    printed.length = length;
+    printed.out = printed.err = -1;
+    strcpy(printed.label, label);
+
+    if (start) {
+        printed.start = *start;
+        clock_gettime(CLOCK_MONOTONIC, &printed.stop);
+    }
+
+    results_write(xa, &printed);
+}
+
+/*
+ * Is the command one of our built in commands?
+ */
+static builtin_e builtin_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; builtin_names[i]; i++) {
+        if (!strcmp(builtin_names[i], name)) {
+            return i;
+        }
+    }
+
+    return BUILTIN_NONE;
+}
+
+/*
+ * Start a built in command. When the output of commands is captured,
+ * so is the output of the built in command, to be reported in turn.
+ */
+static int builtin_begin(xarmour_t *xa, builtin_t *b, const command_t *cmd)
+{
+    memset(b, 0, sizeof(builtin_t));
+
+    b->kind = cmd->builtin;
+    b->cmd = cmd;
+    b->out = -1;
+
+    if (xa->capture) {
+        b->out = capture_open("xarmour-stdout");
+        if (b->out < 0) {
+            fprintf(stderr, "%s: Could not capture output: %s\n", xa->name,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (b->kind == BUILTIN_SHA256) {
+        sha256_init(&b->sha);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &b->start);
+
+    return 0;
+}
+
+static void builtin_write(builtin_t *b, const char *buf, size_t len)
+{
+    if (b->out >= 0) {
+        write_all(b->out, buf, len);
+    }
+    else {
+        fwrite(buf, 1, len, stdout);
+    }
+}
+
+/*
+ * Feed part of the armour to the built in command, as if written to the
+ * stdin of a child.
+ */
+static void builtin_data(builtin_t *b, const char *buf, size_t len)
+{
+    size_t i;
+
+    switch (b->kind) {
+    case BUILTIN_CAT:
+        builtin_write(b, buf, len);
+        break;
+    case BUILTIN_WC:
+        b->bytes += len;
+        for (i = 0; i < len; i++) {
+            if (buf[i] == '\n') {
+                b->lines++;
+            }
+            if (isspace((unsigned char)buf[i])) {
+                b->inword = 0;
+            }
+            else if (!b->inword) {
+                b->inword = 1;
+                b->words++;
+            }
+        }
+        break;
+    case BUILTIN_SHA256:
+        sha256_update(&b->sha, buf, len);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * The armour is complete, report as the equivalent command would have.
+ */
+static void builtin_end(xarmour_t *xa, builtin_t *b)
+{
+    char buf[128];
+
+    switch (b->kind) {
+    case BUILTIN_WC:
+        builtin_write(b, buf, snprintf(buf, sizeof(buf), "%7ld %7ld %7ld\n",
+                b->lines, b->words, b->bytes));
+        break;
+    case BUILTIN_SHA256: {
+        unsigned char digest[32];
+        char hex[65];
+
+        sha256_final(&b->sha, digest);
+        hex_encode(digest, sizeof(digest), hex);
+        builtin_write(b, buf, snprintf(buf, sizeof(buf), "%s  -\n", hex));
+        break;
+    }
+    case BUILTIN_COUNT:
+        xa->counted++;
+        break;
+    default:
+        break;
+    }
+
+    if (xa->capture) {
+        fflush(stdout);
+    }
+
+    b->kind = BUILTIN_NONE;
+}
+
+/*
+ * Set up a command, recognising our built in commands, and parsing any
+ * arguments with placeholders.
+ */
+static int command_init(const char *name, command_t *cmd, char **argv)
+{
+    int i, nargs;
+
+    cmd->argv = argv;
+    cmd->args = NULL;
+
+    cmd->builtin = builtin_lookup(argv[0]);
+    if (argv[0][0] == '@' && cmd->builtin == BUILTIN_NONE) {
+        fprintf(stderr, "%s: Unknown built in command '%s'.\n", name, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (nargs = 0; argv[nargs]; nargs++);
+
+    for (i = 0; i < nargs; i++) {
+        template_t *t;
+
+        if (!strchr(argv[i], '{')) {
+            continue;
+        }
+
+        t = malloc(sizeof(template_t));
+        if (!t || template_parse(t, argv[i], (1 << TPL_INDEX) | (1 << TPL_LABEL)
+                | (1 << TPL_COUNT) | (1 << TPL_OFFSET) | (1 << TPL_FILE), 0)) {
+            fprintf(stderr, "%s: Out of memory\n", name);
+            return EXIT_FAILURE;
+        }
+
+        /* nothing to substitute after all */
+        if (t->nparts <= 1 && (!t->nparts || t->kinds[0] == TPL_LITERAL)) {
+            free(t);
+            continue;
+        }
+
+        if (!cmd->args) {
+            cmd->args = calloc(nargs, sizeof(template_t *));
+            if (!cmd->args) {
+                fprintf(stderr, "%s: Out of memory\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+
+        cmd->args[i] = t;
+    }
+
+    return 0;
+}
+
+/*
+ * Does the command line change from one armoured text to the next, other
+ * than by label?
+ */
+static int command_varies(const command_t *cmd)
+{
+    int i;
+
+    for (i = 0; cmd->args && cmd->argv[i]; i++) {
+        const template_t *t = cmd->args[i];
+
+        if (t && (template_uses(t, TPL_INDEX) || template_uses(t, TPL_COUNT)
+                || template_uses(t, TPL_OFFSET) || template_uses(t, TPL_FILE))) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Enlarge the pipe to a command so that an armoured text of the given
+ * size fits in one go, up to the system limit. Pipes start at 64k, which
+ * is plenty for a certificate but not for a large message. Failure to
+ * grow the pipe is harmless, we just write in smaller pieces.
+ */
+static void pipe_size(xarmour_t *xa, int fd, long long size)
+{
+#ifdef F_SETPIPE_SZ
+    if (size <= 65536) {
+        return;
+    }
+
+    if (!xa->pipe_max) {
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+
+        if (!f || fscanf(f, "%ld", &xa->pipe_max) != 1 || xa->pipe_max < 0) {
+            xa->pipe_max = 1048576;
+        }
+        if (f) {
+            fclose(f);
+        }
+    }
+
+    if (size > xa->pipe_max) {
+        size = xa->pipe_max;
+    }
+
+    fcntl(fd, F_SETPIPE_SZ, (int)size);
+#else
+    (void)xa;
+    (void)fd;
+    (void)size;
+#endif
+}
+
+/*
+ * Start up the command for the armour described by the child.
+ */
+static int child_spawn(xarmour_t *xa, child_t *child, long long size)
+{
+    int pipefd[2] = { -1, -1 };
+
+    /* armour already in a file is passed as is */
+    if (child->file >= 0) {
+        pipefd[READ_FD] = child->file;
+    }
+
+#ifdef HAVE_PIPE2
+    else if (pipe2(pipefd, O_CLOEXEC)) {
+#else
+    else if (pipe(pipefd) || fcntl(pipefd[READ_FD], F_SETFD, FD_CLOEXEC)
+            || fcntl(pipefd[WRITE_FD], F_SETFD, FD_CLOEXEC)) {
+#endif
+        fprintf(stderr, "%s: Could not create pipe: %s", xa->name,
+                strerror(errno));
+
+        return EXIT_FAILURE;
+    }
+
+    child->out = child->err = -1;
+
+    if (xa->capture) {
+
+        child->out = capture_open("xarmour-stdout");
+        child->err = capture_open("xarmour-stderr");
+
+        if (child->out < 0 || child->err < 0) {
+            fprintf(stderr, "%s: Could not capture output: %s",
+                    xa->name, strerror(errno));
+
+            return EXIT_FAILURE;
+        }
+
+    }
+
+    /* Clear any inherited settings */
+    signal(SIGCHLD, SIG_DFL);
+
+    /* keep anything we wrote ahead of what the child writes */
+    fflush(stdout);
+
+    clock_gettime(CLOCK_MONOTONIC, &child->start);
+
+    child->pid = fork();
+
+    /* error */
+    if (child->pid < 0) {
+        fprintf(stderr, "%s: Could not fork: %s", xa->name,
+                strerror(errno));
+
+        return EXIT_FAILURE;
+    }
+
+    /* child */
+    else if (child->pid == 0) {
+
+        char buf[128];
+        char **argv;
+
+        if (child->last > child->index) {
+            snprintf(buf, sizeof(buf), "%ld-%ld", child->index, child->last);
+        }
+        else {
+            snprintf(buf, sizeof(buf), "%ld", child->index);
+        }
+        setenv("XARMOUR_INDEX", buf, 1);
+
+        snprintf(buf, sizeof(buf), "%ld", child->blocks);
+        setenv("XARMOUR_BLOCKS", buf, 1);
+
+        snprintf(buf, sizeof(buf), "%ld", xa->count);
+        setenv("XARMOUR_COUNT", buf, 1);
+
+        snprintf(buf, sizeof(buf), "%ld", xa->times);
+        setenv("XARMOUR_TIMES", buf, 1);
+
+        setenv("XARMOUR_LABEL", child->label, 1);
+
+        if (child->source.path) {
+            setenv("XARMOUR_FILE", child->source.path, 1);
+        }
+        if (child->source.member) {
+            setenv("XARMOUR_MEMBER", child->source.member, 1);
+        }
+
+        /* we ignore SIGPIPE, the command should not */
+        signal(SIGPIPE, SIG_DFL);
+
+        dup2(pipefd[READ_FD], STDIN_FILENO);
+
+        if (child->out >= 0) {
+            dup2(child->out, STDOUT_FILENO);
+        }
+        if (child->err >= 0) {
+            dup2(child->err, STDERR_FILENO);
+        }
+
+        argv = child->cmd->argv;
+
+        /* substitute the placeholders, we are about to exec anyway */
+        if (child->cmd->args) {
+            template_vars_t vars = { 0 };
+            int i, nargs;
+
+            vars.index = getenv("XARMOUR_INDEX");
+            vars.label = child->label;
+            vars.count = xa->count;
+            vars.offset = child->offset;
+            vars.file = child->file >= 0 ? "/dev/fd/0" : "/dev/stdin";
+
+            for (nargs = 0; child->cmd->argv[nargs]; nargs++);
+
+            argv = calloc(nargs + 1, sizeof(char *));
+
+            for (i = 0; argv && i < nargs; i++) {
+                const template_t *t = child->cmd->args[i];
+
+                if (t) {
+                    size_t size = template_size(t);
+
+                    argv[i] = malloc(size);
+                    if (!argv[i]) {
+                        argv = NULL;
+                        break;
+                    }
+                    template_expand(t, argv[i], size, &vars, 0);
+                }
+                else {
+                    argv[i] = child->cmd->argv[i];
+                }
+            }
+
+            if (!argv) {
+                fprintf(stderr, "%s: Out of memory\n", xa->name);
+                _exit(EXIT_FAILURE);
+            }
+        }
+
+        execvp(argv[0], argv);
+
+        fprintf(stderr, "%s: Could not execute '%s', giving up: %s\n", xa->name,
+                child->cmd->argv[0], strerror(errno));
+
+        _exit(EXIT_FAILURE);
+    }
+
+    /* parent */
+    if (child->file < 0) {
+        close(pipefd[READ_FD]);
+
+        pipe_size(xa, pipefd[WRITE_FD], size);
+
+        /* never wait on a command that is not reading */
+        fcntl(pipefd[WRITE_FD], F_SETFL,
+                fcntl(pipefd[WRITE_FD], F_GETFL) | O_NONBLOCK);
+    }
+    child->in = pipefd[WRITE_FD];
+
+    xa->running++;
+    xa->held++;
+
+    return 0;
+}
+
+/*
+ * Take a buffer from the pool of spare buffers, if one is available.
+ */
+static void slab_get(xarmour_t *xa, buffer_t *b)
+{
+    if (b->data) {
+        return;
+    }
+
+    if (xa->nslabs) {
+        *b = xa->slabs[--xa->nslabs];
+        xa->slabs_reused++;
+    }
+    else {
+        xa->slabs_allocated++;
+    }
+}
+
+/*
+ * Return a buffer to the pool. The pool never holds more buffers than
+ * we have commands, and buffers grown for unusually large armour are
+ * given back to the system.
+ */
+static void slab_put(xarmour_t *xa, buffer_t *b)
+{
+    if (b->data && b->size <= MAX_SLAB && xa->nslabs < xa->window) {
+        b->len = 0;
+        xa->slabs[xa->nslabs++] = *b;
+    }
+    else {
+        free(b->data);
+    }
+
+    memset(b, 0, sizeof(buffer_t));
+}
+
+/*
+ * Stop writing to a command, discarding anything not yet written.
+ */
+static void child_drop(xarmour_t *xa, child_t *child)
+{
+    if (child->in >= 0) {
+        close(child->in);
+        child->in = -1;
+    }
+
+    xa->buffered -= child->pending.len;
+
+    slab_put(xa, &child->pending);
+}
+
+/*
+ * Write as much of the pending armour to the command as the pipe will
+ * take without blocking. A command that has gone away is dropped, and
+ * once we are done with the command and nothing is left, stdin is
+ * closed.
+ */
+static void child_flush(xarmour_t *xa, child_t *child)
+{
+    size_t done = 0;
+
+    while (child->in >= 0 && done < child->pending.len) {
+        ssize_t w = write(child->in, child->pending.data + done,
+                child->pending.len - done);
+
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                /* EPIPE and friends, the command is not listening */
+                child_drop(xa, child);
+                return;
+            }
+            break;
+        }
+
+        done += w;
+    }
+
+    if (done) {
+        memmove(child->pending.data, child->pending.data + done,
+                child->pending.len - done);
+        child->pending.len -= done;
+        xa->buffered -= done;
+    }
+
+    if (child->closed && !child->pending.len) {
+        child_drop(xa, child);
+    }
+}
+
+/*
+ * Wait until the held back armour of at least one command has been
+ * written, or the command has gone away. Returns zero if nothing is
+ * held back.
+ */
+static int children_pump(xarmour_t *xa)
+{
+    struct pollfd *fds;
+    long int i, n = 0;
+
+    fds = calloc(xa->window, sizeof(struct pollfd));
+    if (!fds) {
+        return 0;
+    }
+
+    for (i = 0; i < xa->window; i++) {
+        child_t *child = &xa->children[i];
+
+        if (child->used && child->in >= 0 && child->pending.len) {
+            fds[n].fd = child->in;
+            fds[n].events = POLLOUT;
+            n++;
+        }
+    }
+
+    if (n && poll(fds, n, -1) > 0) {
+        for (i = 0; i < xa->window; i++) {
+            child_t *child = &xa->children[i];
+
+            if (child->used && child->in >= 0 && child->pending.len) {
+                child_flush(xa, child);
+            }
+        }
+    }
+
+    free(fds);
+
+    return n > 0;
+}
+
+/*
+ * The results of commands that succeeded, kept from one run to the
+ * next. The table lives in a file mapped into memory, and is shared by
+ * every run using the same directory. Each slot holds the digest of the
+ * armour and the command, and when the command last succeeded on it.
+ */
+typedef struct cache_slot_t {
+    unsigned char digest[32];
+    int64_t stored;
+} cache_slot_t;
+
+typedef struct cache_header_t {
+    char magic[8];
+    uint64_t nslots;
+} cache_header_t;
+
+typedef struct cache_t {
+    int fd;
+    cache_header_t *header;
+    cache_slot_t *slots;
+    uint64_t nslots;
+    size_t size;
+    long int hits;
+    long int misses;
+} cache_t;
+
+/*
+ * Make a fresh table of the size asked for, and put it in place of a
+ * table we do not recognise. The old table may still be mapped by
+ * another run, so it is never resized under that run's feet.
+ */
+static int cache_replace(cache_t *c, const char *path, mode_t mode)
+{
+    char tmp[PATH_MAX];
+    int fd;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    flock(fd, LOCK_EX);
+
+    /* shared as widely as the table it replaces */
+    if (fchmod(fd, mode & 07777) || ftruncate(fd, c->size)
+            || rename(tmp, path)) {
+        int err = errno;
+
+        unlink(tmp);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    close(c->fd);
+    c->fd = fd;
+
+    return 0;
+}
+
+/*
+ * Open the table in the given directory. A table already there is used
+ * at the size it was made; a new table is made as big as asked.
+ */
+static int cache_open(xarmour_t *xa, const char *dir)
+{
+    cache_t *c;
+    struct stat st;
+    cache_header_t header;
+    char path[PATH_MAX];
+
+    c = calloc(1, sizeof(cache_t));
+    if (!c) {
+        fprintf(stderr, "%s: Out of memory\n", xa->name);
+        return EXIT_FAILURE;
+    }
+
+    c->nslots = (xa->cache_size - sizeof(cache_header_t))
+            / sizeof(cache_slot_t);
+    c->size = sizeof(cache_header_t) + c->nslots * sizeof(cache_slot_t);
+
+    snprintf(path, sizeof(path), "%s/xarmour.cache", dir);
+
+    c->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (c->fd < 0) {
+        fprintf(stderr, "%s: Could not open cache '%s': %s\n", xa->name, path,
+                strerror(errno));
+        free(c);
+        return EXIT_FAILURE;
+    }
+
+    flock(c->fd, LOCK_EX);
+
+    if (fstat(c->fd, &st)) {
+        goto fail;
+    }
+
+    /* a table of our own making, whatever its size */
+    if (st.st_size >= (off_t)CACHE_MIN
+            && pread(c->fd, &header, sizeof(header), 0) == sizeof(header)
+            && !memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic))
+            && header.nslots == (st.st_size - sizeof(cache_header_t))
+                    / sizeof(cache_slot_t)
+            && !((st.st_size - sizeof(cache_header_t)) % sizeof(cache_slot_t))) {
+        c->nslots = header.nslots;
+        c->size = st.st_size;
+    }
+
+    /* nobody has mapped an empty table yet */
+    else if (!st.st_size) {
+        if (ftruncate(c->fd, c->size)) {
+            goto fail;
+        }
+    }
+
+    else if (cache_replace(c, path, st.st_mode)) {
+        goto fail;
+    }
+
+    c->header = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd,
+            0);
+    if (c->header == MAP_FAILED) {
+        fprintf(stderr, "%s: Could not map cache '%s': %s\n", xa->name, path,
+                strerror(errno));
+        close(c->fd);
+        free(c);
+        return EXIT_FAILURE;
+    }
+
+    c->slots = (cache_slot_t *)(c->header + 1);
+
+    /* a new table is started empty */
+    if (memcmp(c->header->magic, CACHE_MAGIC, sizeof(c->header->magic))) {
+        memcpy(c->header->magic, CACHE_MAGIC, sizeof(c->header->magic));
+        c->header->nslots = c->nslots;
+    }
+
+    flock(c->fd, LOCK_UN);
+
+    xa->cache = c;
+
+    return 0;
+
+fail:
+    fprintf(stderr, "%s: Could not size cache '%s': %s\n", xa->name, path,
+            strerror(errno));
+    close(c->fd);
+    free(c);
+    return EXIT_FAILURE;
+}
+
+/*
+ * The key of a command run over some armour: the armour itself, the
+ * command line, the label, and the PATH and directory the command is
+ * run from.
+ */
+static void cache_key(const command_t *cmd, const char *label,
+        const char *data, size_t len, unsigned char digest[32])
+{
+    char cwd[PATH_MAX];
+    const char *path = getenv("PATH");
+    sha256_t s;
+    int i;
+
+    sha256_init(&s);
+
+    for (i = 0; cmd->argv[i]; i++) {
+        sha256_update(&s, cmd->argv[i], strlen(cmd->argv[i]) + 1);
+    }
+    sha256_update(&s, "", 1);
+
+    sha256_update(&s, label, strlen(label) + 1);
+
+    if (path) {
+        sha256_update(&s, path, strlen(path));
+    }
+    sha256_update(&s, "", 1);
+
+    if (getcwd(cwd, sizeof(cwd))) {
+        sha256_update(&s, cwd, strlen(cwd));
+    }
+    sha256_update(&s, "", 1);
+
+    sha256_update(&s, data, len);
+
+    sha256_final(&s, digest);
+}
+
+/*
+ * Where the key would live, probing a few slots along from the slot
+ * the key hashes to.
+ */
+static uint64_t cache_home(const cache_t *c, const unsigned char digest[32])
+{
+    uint64_t h;
+
+    memcpy(&h, digest, sizeof(h));
+
+    return h % c->nslots;
+}
+
+/*
+ * Did the command succeed on this armour before, and not too long ago?
+ */
+static int cache_lookup(xarmour_t *xa, const unsigned char digest[32])
+{
+    cache_t *c = xa->cache;
+    uint64_t home = cache_home(c, digest);
+    int64_t now = time(NULL);
+    int i, hit = 0;
+
+    flock(c->fd, LOCK_SH);
+
+    for (i = 0; i < CACHE_PROBE; i++) {
+        cache_slot_t *slot = &c->slots[(home + i) % c->nslots];
+
+        if (!memcmp(slot->digest, digest, sizeof(slot->digest))) {
+            hit = now - slot->stored < xa->cache_ttl;
+            break;
+        }
+    }
+
+    flock(c->fd, LOCK_UN);
+
+    if (hit) {
+        c->hits++;
+    }
+    else {
+        c->misses++;
+    }
+
+    return hit;
+}
+
+/*
+ * Remember that the command succeeded on this armour. The key takes its
+ * old slot if it has one, otherwise an empty or expired slot, and when
+ * all are in use, the oldest.
+ */
+static void cache_store(xarmour_t *xa, const unsigned char digest[32])
+{
+    cache_t *c = xa->cache;
+    uint64_t home = cache_home(c, digest);
+    int64_t now = time(NULL);
+    cache_slot_t *victim = NULL;
+    int i;
+
+    flock(c->fd, LOCK_EX);
+
+    for (i = 0; i < CACHE_PROBE; i++) {
+        cache_slot_t *slot = &c->slots[(home + i) % c->nslots];
+
+        if (!memcmp(slot->digest, digest, sizeof(slot->digest))) {
+            victim = slot;
+            break;
+        }
+
+        if (!victim || (victim->stored && (!slot->stored
+                || now - slot->stored >= xa->cache_ttl
+                || slot->stored < victim->stored))) {
+            victim = slot;
+        }
+    }
+
+    memcpy(victim->digest, digest, sizeof(victim->digest));
+    victim->stored = now;
+
+    flock(c->fd, LOCK_UN);
+}
+
+/*
+ * An armoured text seen before in this run, and how the command fared
+ * on it. Duplicates arriving while the command runs are held in dups,
+ * to share its outcome once known.
+ */
+typedef enum dedup_e {
+    DEDUP_PENDING,
+    DEDUP_SUCCEEDED,
+    DEDUP_FAILED
+} dedup_e;
+
+typedef struct dedup_entry_t {
+    uint64_t hash;
+    unsigned char digest[32];
+    long int index;
+    long int dups;
+    dedup_e state;
+} dedup_entry_t;
+
+/*
+ * The armoured texts seen so far. The table holds the position of each
+ * entry plus one, probed by a fast hash of the armour, and a match on
+ * the fast hash is confirmed by the SHA-256 digest. Entries are added in
+ * index order.
+ */
+typedef struct dedup_t {
+    uint32_t *table;
+    uint64_t mask;
+    dedup_entry_t *entries;
+    long int nentries;
+    long int aentries;
+    long int skipped;
+} dedup_t;
+
+/*
+ * A fast hash of the armour, eight bytes at a time.
+ */
+static uint64_t dedup_hash(const unsigned char *data, size_t len)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    uint64_t h = 0x8445d61a4e774912ULL ^ (len * m), k;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&k, data + i, sizeof(k));
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    for (k = 0; i < len; i++) {
+        k = (k << 8) | data[i];
+    }
+    h ^= k;
+    h *= m;
+
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+
+    return h;
+}
+
+static int dedup_grow(dedup_t *d)
+{
+    uint64_t size = d->mask ? (d->mask + 1) * 2 : 1024, i;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    long int j;
+
+    if (!table) {
+        return -1;
+    }
+
+    for (j = 0; j < d->nentries; j++) {
+        for (i = d->entries[j].hash & (size - 1); table[i];
+                i = (i + 1) & (size - 1));
+        table[i] = j + 1;
+    }
+
+    free(d->table);
+    d->table = table;
+    d->mask = size - 1;
+
+    return 0;
+}
+
+/*
+ * Have we seen this armour before? New armour is remembered, and a
+ * duplicate is counted as the first was, if asked. Returns 1 for a
+ * duplicate, 0 for new armour, and EXIT_FAILURE on error.
+ */
+static int dedup_seen(xarmour_t *xa, const buffer_t *block, int spill)
+{
+    dedup_t *d = xa->dedup;
+    const unsigned char *data = (const unsigned char *)block->data;
+    size_t len = block->len;
+    unsigned char digest[32];
+    dedup_entry_t *e;
+    uint64_t hash, i;
+    void *map = NULL;
+    sha256_t s;
+    int confirmed = 0;
+
+    if (spill >= 0 && (len = spill_size(spill))) {
+        map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, spill, 0);
+
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "%s: Could not map spilled armour: %s\n",
+                    xa->name, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        data = map;
+    }
+
+    hash = dedup_hash(data, len);
+
+    sha256_init(&s);
+    sha256_update(&s, data, len);
+    sha256_final(&s, digest);
+
+    if (map) {
+        munmap(map, len);
+    }
+
+    if ((d->nentries + 1) * 2 > (long int)(d->mask + 1) && dedup_grow(d)) {
+        fprintf(stderr, "%s: Out of memory\n", xa->name);
+        return EXIT_FAILURE;
+    }
+
+    for (i = hash & d->mask; d->table[i]; i = (i + 1) & d->mask) {
+        e = &d->entries[d->table[i] - 1];
+
+        if (e->hash == hash
+                && !memcmp(e->digest, digest, sizeof(digest))) {
+            confirmed = 1;
+            break;
+        }
+    }
+
+    if (confirmed) {
+
+        d->skipped++;
+
+        if (xa->dedup_count) {
+            if (e->state == DEDUP_SUCCEEDED) {
+                xa->count++;
+            }
+            else if (e->state == DEDUP_PENDING) {
+                e->dups++;
+            }
+        }
+
+        return 1;
+    }
+
+    if (d->nentries == d->aentries) {
+        long int a = d->aentries ? d->aentries * 2 : 1024;
+        dedup_entry_t *x = realloc(d->entries, a * sizeof(dedup_entry_t));
+
+        if (!x) {
+            fprintf(stderr, "%s: Out of memory\n", xa->name);
+            return EXIT_FAILURE;
+        }
+
+        d->entries = x;
+        d->aentries = a;
+    }
+
+    e = &d->entries[d->nentries++];
+    e->hash = hash;
+    memcpy(e->digest, digest, sizeof(digest));
+    e->index = xa->index;
+    e->dups = 0;
+    e->state = DEDUP_PENDING;
+
+    d->table[i] = d->nentries;
+
+    return 0;
+}
+
+/*
+ * The command has finished with the armour from index to last, so the
+ * duplicates of that armour know how to be counted. The range may have
+ * gaps where duplicates were skipped, so last must be the index of the
+ * last armour actually passed, not worked out from the count.
+ */
+static void dedup_settle(xarmour_t *xa, long int index, long int last,
+        int succeeded)
+{
+    dedup_t *d = xa->dedup;
+    long int lo = 0, hi = d->nentries;
+
+    while (lo < hi) {
+        long int mid = (lo + hi) / 2;
+
+        if (d->entries[mid].index < index) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    for (; lo < d->nentries && d->entries[lo].index <= last; lo++) {
+        dedup_entry_t *e = &d->entries[lo];
+
+        e->state = succeeded ? DEDUP_SUCCEEDED : DEDUP_FAILED;
+
+        if (succeeded && xa->dedup_count) {
+            xa->count += e->dups;
+        }
+        e->dups = 0;
+    }
+}
+
+/*
+ * Pass armour to the command. Whatever the pipe will not take right now
+ * is held back and written later, leaving us free to carry on reading,
+ * unless too much is held back already, in which case we wait for the
+ * commands to catch up.
+ */
+static int child_write(xarmour_t *xa, child_t *child, const char *buf,
+        size_t len)
+{
+    if (child->in < 0) {
+        return 0;
+    }
+
+    slab_get(xa, &child->pending);
+
+    if (buffer_append(&child->pending, buf, len)) {
+        fprintf(stderr, "%s: Out of memory\n", xa->name);
+        return EXIT_FAILURE;
+    }
+
+    xa->buffered += len;
+    if (xa->buffered > xa->peak_buffered) {
+        xa->peak_buffered = xa->buffered;
+    }
+
+    child_flush(xa, child);
+
+    while (xa->buffered > xa->max_buffered && children_pump(xa));
+
+    return 0;
+}
+
+/*
+ * Report the outcome of a child that has exited and whose armour is
+ * complete, and decide whether we carry on.
+ */
+static void child_report(xarmour_t *xa, child_t *child)
+{
+    int status = child->status;
+
+    results_write(xa, child);
+
+    /* pass through any captured output */
+    if (child->out >= 0 || child->err >= 0) {
+        char prefix[MAX_LINE + 32];
+
+        snprintf(prefix, sizeof(prefix), "%ld\t%s\t", child->index,
+                child->label);
+
+        fflush(stdout);
+        capture_copy(child->out, STDOUT_FILENO, xa->tag ? prefix : NULL);
+        capture_copy(child->err, STDERR_FILENO, xa->tag ? prefix : NULL);
+    }
+    if (child->out >= 0) {
+        close(child->out);
+    }
+    if (child->err >= 0) {
+        close(child->err);
+    }
+
+    child_drop(xa, child);
+    source_free(&child->source);
+
+    child->used = 0;
+    xa->held--;
+
+    /* duplicates of this armour share its outcome */
+    if (xa->dedup) {
+        dedup_settle(xa, child->index, child->last, !child->truncated
+                && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    /* armour cut short by the end of the input, outcome is ignored */
+    if (child->truncated) {
+
+        /* drop through */
+    }
+
+    /* process successful exit */
+    else if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+
+        /* drop through */
+        xa->count += xa->count_blocks ? child->blocks : 1;
+
+        /* next time, the command need not run at all */
+        if (child->keyed) {
+            cache_store(xa, child->digest);
+        }
+    }
+
+    /* must we ignore failures, or have we already failed? */
+    else if (xa->times || xa->halt) {
+
+        /* drop through */
+    }
+
+    /* process non success exit */
+    else if (WIFEXITED(status)) {
+
+        fprintf(stderr, "%s: %s returned %d\n", xa->name,
+                child->cmd->argv[0], status);
+
+        xa->halt = 1;
+        xa->exit = WEXITSTATUS(status);
+    }
+
+    /* process received a signal */
+    else if (WIFSIGNALED(status)) {
+
+        fprintf(stderr, "%s: %s signaled %d\n", xa->name,
+                child->cmd->argv[0], status);
+
+        xa->halt = 1;
+        xa->exit = WTERMSIG(status) + 128;
+    }
+
+    /* otherwise weirdness, just leave */
+    else {
+
+        fprintf(stderr, "%s: %s failed with %d\n", xa->name,
+                child->cmd->argv[0], status);
+
+        xa->halt = 1;
+        xa->exit = EX_OSERR;
+    }
+
+}
+
+/*
+ * Report every child whose outcome is ready. When keeping order, we only
+ * report the earliest outstanding armour, and everything after it waits.
+ */
+static void children_collate(xarmour_t *xa)
+{
+    long int i;
+
+    for (;;) {
+        child_t *ready = NULL, *first = NULL;
+
+        for (i = 0; i < xa->window; i++) {
+            child_t *child = &xa->children[i];
+
+            if (!child->used) {
+                continue;
+            }
+            if (!first || child->index < first->index) {
+                first = child;
+            }
+            if (!ready && child->exited && child->closed) {
+                ready = child;
+            }
+        }
+
+        if (xa->keep_order) {
+            ready = (first && first->exited && first->closed) ? first : NULL;
+        }
+
+        if (!ready) {
+            break;
+        }
+
+        child_report(xa, ready);
+    }
+}
+
+/*
+ * Wait for any one child to exit, and report whatever is ready.
+ */
+static int children_reap(xarmour_t *xa)
+{
+    struct rusage usage;
+    int status;
+    long int i;
+    pid_t w;
+
+    /* a command may be waiting on us before it can exit */
+    while (children_pump(xa));
+
+    do {
+        w = wait4(-1, &status, 0, &usage);
+    } while (w == -1 && errno == EINTR);
+
+    /* waitpid failed, we give up */
+    if (w == -1) {
+
+        fprintf(stderr, "%s: waitpid for '%s' failed: %s\n", xa->name,
+                xa->command, strerror(errno));
+
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < xa->window; i++) {
+        child_t *child = &xa->children[i];
+
+        if (child->used && !child->exited && child->pid == w) {
+
+            clock_gettime(CLOCK_MONOTONIC, &child->stop);
+
+            child->status = status;
+            child->usage = usage;
+            child->exited = 1;
+
+            xa->running--;
+
+            break;
+        }
+    }
+
+    children_collate(xa);
+
+    return 0;
+}
+
+/*
+ * Wait for room to start another command, and take a slot for the
+ * armour beginning at the given offset. If an earlier command failed
+ * while we waited, no slot is taken.
+ */
+static int children_slot(xarmour_t *xa, child_t **started,
+        const command_t *cmd, const source_t *source,
+        const char *label, long int index, long int last, long int blocks,
+        long long offset, int file)
+{
+    child_t *child;
+    long int i;
+    int rv;
+
+    while (!xa->halt
+            && (xa->running >= xa->jobs || xa->held >= xa->window)) {
+        if ((rv = children_reap(xa))) {
+            return rv;
+        }
+    }
+
+    if (xa->halt) {
+        return 0;
+    }
+
+    for (i = 0; xa->children[i].used; i++);
+
+    child = &xa->children[i];
+    memset(child, 0, sizeof(child_t));
+
+    child->used = 1;
+    child->file = -1;
+    child->cmd = cmd;
+    if (source_copy(&child->source, source)) {
+        fprintf(stderr, "%s: Out of memory\n", xa->name);
+        child->used = 0;
+        return EXIT_FAILURE;
+    }
+    child->index = index;
+    child->last = last;
+    child->blocks = blocks;
+    child->offset = offset;
+    child->file = file;
+    strcpy(child->label, label);
+
+    *started = child;
+
+    return 0;
+}
+
+/*
+ * Start a command for the armour beginning at the given offset,
+ * expected to be roughly the given size.
+ */
+static int children_start(xarmour_t *xa, child_t **started,
+        const command_t *cmd, const source_t *source,
+        const char *label, long int index, long int last, long int blocks,
+        long long offset, int file, long long size)
+{
+    int rv;
+
+    *started = NULL;
+
+    if ((rv = children_slot(xa, started, cmd, source, label, index, last,
+            blocks, offset, file)) || !*started) {
+        return rv;
+    }
+
+    return child_spawn(xa, *started, size);
+}
+
+/*
+ * The command succeeded on this armour before, so it need not run
+ * again. The armour takes a slot all the same, so that it is reported
+ * in turn.
+ */
+static int children_cached(xarmour_t *xa, const command_t *cmd,
+        const source_t *source, const char *label, long int index,
+        long int last, long int blocks, long long offset, long long length)
+{
+    child_t *child = NULL;
+    int rv;
+
+    if ((rv = children_slot(xa, &child, cmd, source, label, index, last,
+            blocks, offset, -1)) || !child) {
+        return rv;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &child->start);
+    child->stop = child->start;
+    child->in = child->out = child->err = -1;
+    child->length = length;
+    child->cached = 1;
+    child->exited = 1;
+    child->closed = 1;
+
+    xa->held++;
+
+    children_collate(xa);
+
+    return 0;
+}
+
+/*
+ * A built in command has finished with its armour. Its captured output
+ * takes a slot, so that it is reported in turn with the commands still
+ * running, and tagged as theirs would be.
+ */
+static int children_builtin(xarmour_t *xa, builtin_t *b, const char *label,
+        long long offset, long long length)
+{
+    child_t *child = NULL;
+    struct timespec start = b->start;
+    int out = b->out, rv;
+
+    builtin_end(xa, b);
+
+    if ((rv = children_slot(xa, &child, b->cmd, &xa->source, label,
+            xa->index, xa->index, 1, offset, -1)) || !child) {
+        close(out);
+        return rv;
+    }
+
+    child->start = start;
+    clock_gettime(CLOCK_MONOTONIC, &child->stop);
+    child->in = child->err = -1;
+    child->out = out;
+    child->length = length;
+    child->exited = 1;
+    child->closed = 1;
+
+    xa->held++;
+
+    children_collate(xa);
+
+    return 0;
+}
+
+/*
+ * All the armour has been written to the child, so let it finish. When we
+ * run one command at a time, we wait for it here.
+ */
+static int child_close(xarmour_t *xa, child_t *child)
+{
+    int rv;
+
+    child->closed = 1;
+    child_flush(xa, child);
+
+    children_collate(xa);
+
+    while (xa->running >= xa->jobs) {
+        if ((rv = children_reap(xa))) {
+            return rv;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Pass the collected armour to a single command.
+ */
+static int batch_flush(xarmour_t *xa, batch_t *batch)
+{
+    child_t *child = NULL;
+    unsigned char digest[32];
+    int fd = -1, rv;
+
+    if (!batch->blocks) {
+        return 0;
+    }
+
+    if (xa->cache) {
+
+        cache_key(batch->cmd, batch->label, batch->data.data, batch->data.len,
+                digest);
+
+        if (cache_lookup(xa, digest)) {
+
+            rv = children_cached(xa, batch->cmd, &batch->source, batch->label,
+                    batch->first, batch->last,
+                    batch->blocks, batch->offset, batch->data.len);
+
+            batch->data.len = 0;
+            batch->blocks = 0;
+            source_free(&batch->source);
+
+            return rv;
+        }
+    }
+
+    if (xa->memfd) {
+
+        fd = capture_open("xarmour-block");
+
+        if (fd < 0 || write_all(fd, batch->data.data, batch->data.len)
+                || lseek(fd, 0, SEEK_SET) < 0) {
+            fprintf(stderr, "%s: Could not write block: %s\n", xa->name,
+                    strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return EXIT_FAILURE;
+        }
+
+        capture_seal(fd);
+    }
+
+    rv = children_start(xa, &child, batch->cmd, &batch->source,
+            batch->label, batch->first, batch->last,
+            batch->blocks, batch->offset, fd, batch->data.len);
+
+    /* the child has its own copy */
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (rv) {
+        return rv;
+    }
+
+    if (child) {
+
+        child->length = batch->data.len;
+
+        if (xa->cache) {
+            memcpy(child->digest, digest, sizeof(digest));
+            child->keyed = 1;
+        }
+
+        if (fd < 0 && (rv = child_write(xa, child, batch->data.data,
+                batch->data.len))) {
+            return rv;
+        }
+
+        if ((rv = child_close(xa, child))) {
+            return rv;
+        }
+
+    }
+
+    batch->data.len = 0;
+    batch->blocks = 0;
+    source_free(&batch->source);
+
+    return 0;
+}
+
+/*
+ * Add a complete armoured text to the batch, passing the batch on to a
+ * command first if the armoured text would not fit. Spilled armour is
+ * always passed on its own, with the spill file as stdin.
+ */
+static int batch_add(xarmour_t *xa, batch_t *batch, const command_t *cmd,
+        const char *label, const buffer_t *block, int spill, long long offset)
+{
+    int rv;
+
+    if (spill >= 0) {
+        child_t *child = NULL;
+        long long size = spill_size(spill);
+
+        if ((rv = batch_flush(xa, batch)) || xa->halt) {
+            return rv;
+        }
+
+        if (lseek(spill, 0, SEEK_SET) < 0) {
+            fprintf(stderr, "%s: Could not rewind spilled armour: %s\n",
+                    xa->name, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        capture_seal(spill);
+
+        if ((rv = children_start(xa, &child, cmd, &xa->source, label,
+                xa->index, xa->index, 1, offset, spill, size))) {
+            return rv;
+        }
+
+        if (child) {
+            child->length = size;
+
+            return child_close(xa, child);
+        }
+
+        return 0;
+    }
+
+    if (batch->blocks && (batch->cmd != cmd || (xa->max_bytes
+            && batch->data.len + block->len > (size_t)xa->max_bytes))) {
+        if ((rv = batch_flush(xa, batch))) {
+            return rv;
+        }
+    }
+
+    if (xa->halt) {
+        return 0;
+    }
+
+    if (!batch->blocks) {
+        batch->cmd = cmd;
+        if (source_copy(&batch->source, &xa->source)) {
+            fprintf(stderr, "%s: Out of memory\n", xa->name);
+            return EXIT_FAILURE;
+        }
+        batch->first = xa->index;
+        batch->offset = offset;
+        strcpy(batch->label, label);
+    }
+
+    if (buffer_append(&batch->data, block->data, block->len)) {
+        fprintf(stderr, "%s: Out of memory\n", xa->name);
+        return EXIT_FAILURE;
+    }
+
+    batch->last = xa->index;
+    batch->blocks++;
+
+    if ((xa->max_blocks && batch->blocks >= xa->max_blocks)
+            || (xa->max_bytes && batch->data.len >= (size_t)xa->max_bytes)) {
+        return batch_flush(xa, batch);
+    }
+
+    return 0;
+}
+
+/*
+ * Pass all the armour collected for the group to a single command.
+ */
+static int group_flush(xarmour_t *xa, group_t *group)
+{
+    child_t *child = NULL;
+    int rv;
+
+    if (!group->blocks) {
+        return 0;
+    }
+
+    if (lseek(group->fd, 0, SEEK_SET) < 0) {
+        fprintf(stderr, "%s: Could not rewind group: %s\n", xa->name,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    capture_seal(group->fd);
+
+    if ((rv = children_start(xa, &child, group->cmd, &group->source,
+            group->label, group->first, group->last, group->blocks,
+            group->offset, group->fd, group->bytes))) {
+        return rv;
+    }
+
+    if (child) {
+
+        child->length = group->bytes;
+
+        if ((rv = child_close(xa, child))) {
+            return rv;
+        }
+
+    }
+
+    /* the child has its own copy, start afresh */
+    close(group->fd);
+    group->fd = -1;
+    group->blocks = 0;
+    group->bytes = 0;
+    source_free(&group->source);
+
+    return 0;
+}
+
+/*
+ * Add a complete armoured text to the group for its label, passing the
+ * group on to a command first if the armoured text would not fit.
+ */
+static int group_add(xarmour_t *xa, const command_t *cmd, const char *label,
+        const buffer_t *block, int spill, long long offset)
+{
+    group_t *group = NULL;
+    long long len = spill >= 0 ? spill_size(spill) : (long long)block->len;
+    int i, rv;
+
+    for (i = 0; i < xa->ngroups; i++) {
+        if (!strcmp(xa->groups[i].label, label)) {
+            group = &xa->groups[i];
+            break;
+        }
+    }
+
+    if (!group) {
+        group_t *groups = realloc(xa->groups, (xa->ngroups + 1) * sizeof(group_t));
+
+        if (!groups) {
+            fprintf(stderr, "%s: Out of memory\n", xa->name);
+            return EXIT_FAILURE;
+        }
+
+        xa->groups = groups;
+        group = &groups[xa->ngroups++];
+
+        memset(group, 0, sizeof(group_t));
+        group->fd = -1;
+        strcpy(group->label, label);
+    }
+
+    if (group->blocks && xa->max_bytes
+            && group->bytes + len > xa->max_bytes) {
+        if ((rv = group_flush(xa, group))) {
+            return rv;
+        }
+    }
+
+    if (xa->halt) {
+        return 0;
+    }
+
+    if (!group->blocks) {
+
+        group->fd = capture_open("xarmour-group");
+        if (group->fd < 0) {
+            fprintf(stderr, "%s: Could not create group: %s\n", xa->name,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        group->cmd = cmd;
+        if (source_copy(&group->source, &xa->source)) {
+            fprintf(stderr, "%s: Out of memory\n", xa->name);
+            return EXIT_FAILURE;
+        }
+        group->first = xa->index;
+        group->offset = offset;
+    }
+
+    if (spill >= 0 ? spill_copy(spill, group->fd)
+            : write_all(group->fd, block->data, block->len)) {
+        fprintf(stderr, "%s: Could not write group: %s\n", xa->name,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    group->last = xa->index;
+    group->bytes += len;
+    group->blocks++;
+
+    if ((xa->max_blocks && group->blocks >= xa->max_blocks)
+            || (xa->max_bytes && group->bytes >= xa->max_bytes)) {
+        return group_flush(xa, group);
+    }
+
+    return 0;
+}
+
+/*
+ * Add a file to be read, after those already added.
+ */
+static int inputs_add(xarmour_t *xa, const char *path)
+{
+    input_t *input;
+
+    if (xa->ninputs == xa->ainputs) {
+        long int ainputs = xa->ainputs ? xa->ainputs * 2 : 16;
+        input_t *inputs = realloc(xa->inputs, ainputs * sizeof(input_t));
+
+        if (!inputs) {
+            fprintf(stderr, "%s: Out of memory\n", xa->name);
+            return EXIT_FAILURE;
+        }
+
+        xa->inputs = inputs;
+        xa->ainputs = ainputs;
+    }
+
+    input = &xa->inputs[xa->ninputs];
+    memset(input, 0, sizeof(input_t));
+    input->fd = -1;
+
+    input->path = strdup(path);
+    if (!input->path) {
+        fprintf(stderr, "%s: Out of memory\n", xa->name);
+        return EXIT_FAILURE;
+    }
+
+    xa->ninputs++;
+
+    return 0;
+}
+
+typedef struct entry_t {
+    char *name;
+    unsigned char type;
+} entry_t;
+
+static int entry_compare(const void *a, const void *b)
+{
+    return strcmp(((const entry_t *)a)->name, ((const entry_t *)b)->name);
+}
+
+static int entries_push(xarmour_t *xa, entry_t **entries, long int *nentries,
+        long int *aentries, const char *name, unsigned char type)
+{
+    if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        return 0;
+    }
+
+    if (*nentries == *aentries) {
+        long int a = *aentries ? *aentries * 2 : 64;
+        entry_t *e = realloc(*entries, a * sizeof(entry_t));
+
+        if (!e) {
+            fprintf(stderr, "%s: Out of memory\n", xa->name);
+            return EXIT_FAILURE;
+        }
+
+        *entries = e;
+        *aentries = a;
+    }
+
+    (*entries)[*nentries].name = strdup(name);
+    (*entries)[*nentries].type = type;
+
+    if (!(*entries)[*nentries].name) {
+        fprintf(stderr, "%s: Out of memory\n", xa->name);
+        return EXIT_FAILURE;
+    }
+
+    (*nentries)++;
+
+    return 0;
+}
+
+/*
+ * Read the names within a directory. The type of each entry comes with
+ * the name on most filesystems, saving a stat per file.
+ */
+static int entries_read(xarmour_t *xa, int dirfd, const char *path,
+        entry_t **entries, long int *nentries)
+{
+    long int aentries = 0;
+    int rv;
+#ifdef HAVE_GETDENTS64
+    char buf[32768];
+    ssize_t n, pos;
+
+    while ((n = getdents64(dirfd, buf, sizeof(buf))) > 0) {
+        for (pos = 0; pos < n;) {
+            struct dirent64 *d = (struct dirent64 *)(buf + pos);
+
+            pos += d->d_reclen;
+
+            if ((rv = entries_push(xa, entries, nentries, &aentries, d->d_name,
+                    d->d_type))) {
+                return rv;
+            }
+        }
+    }
+
+    if (n < 0) {
+        fprintf(stderr, "%s: Could not read '%s': %s\n", xa->name, path,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+#else
+    struct dirent *d;
+    DIR *dir = NULL;
+    int fd = dup(dirfd);
+
+    if (fd < 0 || !(dir = fdopendir(fd))) {
+        fprintf(stderr, "%s: Could not read '%s': %s\n", xa->name, path,
+                strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return EXIT_FAILURE;
+    }
+
+    while ((d = readdir(dir))) {
+        if ((rv = entries_push(xa, entries, nentries, &aentries, d->d_name,
+                d->d_type))) {
+            closedir(dir);
+            return rv;
+        }
+    }
+
+    closedir(dir);
+#endif
+
+    return 0;
+}
+
+/*
+ * Add the files within a directory in name order, and those within
+ * subdirectories if recursive. Symbolic links to files are followed,
+ * symbolic links to directories are not, so we cannot loop.
+ */
+static int inputs_walk(xarmour_t *xa, int dirfd, const char *path)
+{
+    entry_t *entries = NULL;
+    long int i, nentries = 0;
+    int rv;
+
+    if ((rv = entries_read(xa, dirfd, path, &entries, &nentries))) {
+        return rv;
+    }
+
+    qsort(entries, nentries, sizeof(entry_t), entry_compare);
+
+    for (i = 0; i < nentries && !rv; i++) {
+        char full[PATH_MAX];
+        unsigned char type = entries[i].type;
+        struct stat st;
+
+        snprintf(full, sizeof(full), "%s/%s", path, entries[i].name);
+
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            if (fstatat(dirfd, entries[i].name, &st,
+                    type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW)) {
+                /* dangling link, or gone since */
+                continue;
+            }
+            type = S_ISREG(st.st_mode) ? DT_REG
+                    : S_ISDIR(st.st_mode) && type != DT_LNK ? DT_DIR : 0;
+        }
+
+        if (type == DT_REG) {
+            rv = inputs_add(xa, full);
+        }
+        else if (type == DT_DIR && xa->recursive) {
+            int fd = openat(dirfd, entries[i].name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+            if (fd < 0) {
+                fprintf(stderr, "%s: Could not open '%s': %s\n", xa->name,
+                        full, strerror(errno));
+                rv = EXIT_FAILURE;
+            }
+            else {
+                rv = inputs_walk(xa, fd, full);
+                close(fd);
+            }
+        }
+    }
+
+    for (i = 0; i < nentries; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+
+    return rv;
+}
+
+/*
+ * Open an input, and ask for the contents to be read ahead of time.
+ */
+static void input_open(input_t *input)
+{
+    if (!strcmp(input->path, "-")) {
+        input->fd = dup(STDIN_FILENO);
+    }
+    else {
+        input->fd = open(input->path, O_RDONLY | O_CLOEXEC);
+    }
+
+    if (input->fd < 0) {
+        input->err = errno;
+    }
+#ifdef HAVE_POSIX_FADVISE
+    else {
+        posix_fadvise(input->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(input->fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Open inputs in order, staying no more than a few files ahead of the
+ * scan. With many small files, the time taken to look up and open each
+ * one dominates, and is spread across the readers.
+ */
+static void *reader_run(void *arg)
+{
+    xarmour_t *xa = arg;
+
+    pthread_mutex_lock(&xa->lock);
+
+    for (;;) {
+        input_t *input;
+
+        while (!xa->stop && xa->opened < xa->ninputs
+                && xa->opened >= xa->scanned + READ_AHEAD) {
+            pthread_cond_wait(&xa->cond, &xa->lock);
+        }
+
+        if (xa->stop || xa->opened >= xa->ninputs) {
+            break;
+        }
+
+        input = &xa->inputs[xa->opened++];
+
+        pthread_mutex_unlock(&xa->lock);
+        input_open(input);
+        pthread_mutex_lock(&xa->lock);
+
+        input->ready = 1;
+        pthread_cond_broadcast(&xa->cond);
+    }
+
+    pthread_mutex_unlock(&xa->lock);
+
+    return NULL;
+}
+#endif
+
+/*
+ * Start the readers, if there is more than one input to read.
+ */
+static void readers_start(xarmour_t *xa)
+{
+#ifdef HAVE_PTHREAD
+    int i;
+
+    if (xa->ninputs < 2) {
+        return;
+    }
+
+    pthread_mutex_init(&xa->lock, NULL);
+    pthread_cond_init(&xa->cond, NULL);
+
+    for (i = 0; i < READERS && i < xa->ninputs; i++) {
+        if (pthread_create(&xa->readers[i], NULL, reader_run, xa)) {
+            /* fewer readers, or we open the inputs ourselves */
+            break;
+        }
+        xa->nreaders++;
+    }
+#else
+    (void)xa;
+#endif
+}
+
+static void readers_stop(xarmour_t *xa)
+{
+#ifdef HAVE_PTHREAD
+    int i;
+
+    if (!xa->nreaders) {
+        return;
+    }
+
+    pthread_mutex_lock(&xa->lock);
+    xa->stop = 1;
+    pthread_cond_broadcast(&xa->cond);
+    pthread_mutex_unlock(&xa->lock);
+
+    for (i = 0; i < xa->nreaders; i++) {
+        pthread_join(xa->readers[i], NULL);
+    }
+#else
+    (void)xa;
+#endif
+}
+
+typedef enum decoder_e {
+    DECODE_NONE,
+    DECODE_GZIP,
+    DECODE_XZ,
+    DECODE_ZSTD
+} decoder_e;
+
+static const char *decoder_names[] = { "plain", "gzip", "xz", "zstd" };
+
+/*
+ * Streaming decompression of an input. The decompressed text is read
+ * through a stdio cookie, so the scan is none the wiser.
+ */
+typedef struct decoder_t {
+    decoder_e kind;
+    int fd;
+    int out;
+    int eof;
+    int ended;
+    const char *name;
+    const char *path;
+#ifdef HAVE_DECODE_THREAD
+    atomic_int *failed;
+#endif
+    unsigned char *next;
+    size_t avail;
+#ifdef HAVE_ZLIB
+    z_stream z;
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream x;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zs;
+#endif
+    unsigned char in[65536];
+} decoder_t;
+
+static decoder_e decoder_detect(const unsigned char *magic, size_t len)
+{
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return DECODE_GZIP;
+    }
+    if (len >= 6 && !memcmp(magic, "\xfd" "7zXZ\0", 6)) {
+        return DECODE_XZ;
+    }
+    if (len >= 4 && !memcmp(magic, "\x28\xb5\x2f\xfd", 4)) {
+        return DECODE_ZSTD;
+    }
+
+    return DECODE_NONE;
+}
+
+static int decoder_fill(decoder_t *d)
+{
+    ssize_t n;
+
+    if (d->avail || d->eof) {
+        return 0;
+    }
+
+    do {
+        n = read(d->fd, d->in, sizeof(d->in));
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        return -1;
+    }
+
+    d->next = d->in;
+    d->avail = n;
+    d->eof = !n;
+
+    return 0;
+}
+
+/*
+ * Decompress up to size bytes. Concatenated streams are decompressed one
+ * after the other, as the command line tools do. Returns zero at the end
+ * of the input, and -1 with errno set on failure.
+ */
+static ssize_t decoder_decode(decoder_t *d, char *buf, size_t size)
+{
+    for (;;) {
+        size_t avail, out = 0;
+
+        if (decoder_fill(d)) {
+            return -1;
+        }
+
+        avail = d->avail;
+
+        switch (d->kind) {
+        case DECODE_NONE:
+            out = avail < size ? avail : size;
+            memcpy(buf, d->next, out);
+            d->next += out;
+            d->avail -= out;
+
+            return out;
+#ifdef HAVE_ZLIB
+        case DECODE_GZIP: {
+            int rv;
+
+            /* anything after the last member is not ours to decompress */
+            if (d->ended && d->avail && d->next[0] != 0x1f) {
+                return 0;
+            }
+
+            d->z.next_in = d->next;
+            d->z.avail_in = d->avail;
+            d->z.next_out = (unsigned char *)buf;
+            d->z.avail_out = size;
+
+            rv = inflate(&d->z, Z_NO_FLUSH);
+
+            d->next = d->z.next_in;
+            d->avail = d->z.avail_in;
+            out = size - d->z.avail_out;
+
+            if (rv == Z_STREAM_END) {
+                inflateReset(&d->z);
+                d->ended = 1;
+            }
+            else if (rv == Z_OK) {
+                d->ended = 0;
+            }
+            else if (rv != Z_BUF_ERROR) {
+                errno = EBADMSG;
+                return -1;
+            }
+
+            break;
+        }
+#endif
+#ifdef HAVE_LZMA
+        case DECODE_XZ: {
+            lzma_ret rv;
+
+            d->x.next_in = d->next;
+            d->x.avail_in = d->avail;
+            d->x.next_out = (unsigned char *)buf;
+            d->x.avail_out = size;
+
+            rv = lzma_code(&d->x, d->eof ? LZMA_FINISH : LZMA_RUN);
+
+            d->next = (unsigned char *)d->x.next_in;
+            d->avail = d->x.avail_in;
+            out = size - d->x.avail_out;
+
+            if (rv == LZMA_STREAM_END) {
+                d->ended = 1;
+                return out;
+            }
+            else if (rv != LZMA_OK && rv != LZMA_BUF_ERROR) {
+                errno = EBADMSG;
+                return -1;
+            }
+
+            break;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case DECODE_ZSTD: {
+            ZSTD_inBuffer zin = { d->next, d->avail, 0 };
+            ZSTD_outBuffer zout = { buf, size, 0 };
+            size_t rv = ZSTD_decompressStream(d->zs, &zout, &zin);
+
+            if (ZSTD_isError(rv)) {
+                errno = EBADMSG;
+                return -1;
+            }
+
+            d->next += zin.pos;
+            d->avail -= zin.pos;
+            out = zout.pos;
+
+            /* a frame is complete, another may follow */
+            if (zin.pos || zout.pos) {
+                d->ended = !rv;
+            }
+
+            break;
+        }
+#endif
+        default:
+            errno = ENOTSUP;
+            return -1;
+        }
+
+        if (out) {
+            return out;
+        }
+
+        if (d->eof && !d->avail) {
+            if (d->ended) {
+                return 0;
+            }
+
+            /* the compressed stream was cut short */
+            errno = EBADMSG;
+            return -1;
+        }
+
+        if (avail && d->avail == avail) {
+            /* no progress, and no reason why */
+            errno = EBADMSG;
+            return -1;
+        }
+    }
+}
+
+static void decoder_free(decoder_t *d)
+{
+    switch (d->kind) {
+#ifdef HAVE_ZLIB
+    case DECODE_GZIP:
+        inflateEnd(&d->z);
+        break;
+#endif
+#ifdef HAVE_LZMA
+    case DECODE_XZ:
+        lzma_end(&d->x);
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case DECODE_ZSTD:
+        ZSTD_freeDStream(d->zs);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    close(d->fd);
+    free(d);
+}
+
+static ssize_t decoder_read(void *cookie, char *buf, size_t size)
+{
+    return decoder_decode(cookie, buf, size);
+}
+
+static int decoder_close(void *cookie)
+{
+    decoder_free(cookie);
+
+    return 0;
+}
+
+#ifdef HAVE_DECODE_THREAD
+/*
+ * Decompress into a pipe on a thread of our own, so that decompression
+ * overlaps with the scan. A failure is flagged before the pipe is closed,
+ * to be picked up once the input has been read to the end.
+ */
+static void *decoder_run(void *arg)
+{
+    decoder_t *d = arg;
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = decoder_decode(d, buf, sizeof(buf))) > 0) {
+        if (write_all(d->out, buf, n)) {
+            break;
+        }
+    }
+
+    if (n < 0) {
+        fprintf(stderr, "%s: Could not read '%s': %s\n", d->name, d->path,
+                strerror(errno));
+        atomic_store(d->failed, 1);
+    }
+
+    close(d->out);
+    decoder_free(d);
+
+    return NULL;
+}
+#endif
+
+/*
+ * A tar archive being read one member at a time. Each member reads as a
+ * file of its own, ending where the member ends. Input that turns out
+ * not to be an archive is passed through as is.
+ */
+typedef struct tar_t {
+    FILE *raw;
+    decoder_t *decoder;
+    const char *name;
+    const char *path;
+    int *failed;
+    source_t *source;
+    int checked;
+    int archive;
+    long long remaining;
+    long long pad;
+    long long paxsize;
+    char *longname;
+    char *member;
+    size_t headlen;
+    size_t headpos;
+    unsigned char head[TAR_BLOCK];
+} tar_t;
+
+/*
+ * Numeric fields are octal, or big endian base-256 when the top bit of
+ * the first byte is set.
+ */
+static long long tar_number(const unsigned char *f, size_t len)
+{
+    long long v = 0;
+    size_t i;
+
+    if (f[0] & 0x80) {
+        v = f[0] & 0x3f;
+        for (i = 1; i < len; i++) {
+            v = (v << 8) | f[i];
+        }
+        return v;
+    }
+
+    for (i = 0; i < len && (f[i] == ' ' || f[i] == '0'); i++);
+    for (; i < len && f[i] >= '0' && f[i] <= '7'; i++) {
+        v = (v << 3) | (f[i] - '0');
+    }
+
+    return v;
+}
+
+static int tar_valid(const unsigned char *h)
+{
+    long long sum = 0;
+    int i;
+
+    if (memcmp(h + 257, "ustar", 5)) {
+        return 0;
+    }
+
+    for (i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    }
+
+    return sum == tar_number(h + 148, 8);
+}
+
+static int tar_skip(tar_t *t, long long len)
+{
+    char buf[16384];
+
+    if (len && !fseeko(t->raw, len, SEEK_CUR)) {
+        return 0;
+    }
+
+    while (len > 0) {
+        size_t n = fread(buf, 1, len < (long long)sizeof(buf) ? len
+                : (long long)sizeof(buf), t->raw);
+
+        if (!n) {
+            return -1;
+        }
+
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Take the name and size of the next member from a pax extended header
+ * or a GNU long name.
+ */
+static int tar_extended(tar_t *t, int type, long long size)
+{
+    char *data, *rec, *end;
+
+    if (size > MAX_LINE * 64) {
+        return tar_skip(t, size);
+    }
+
+    data = malloc(size + 1);
+    if (!data) {
+        return -1;
+    }
+
+    if (fread(data, 1, size, t->raw) != (size_t)size) {
+        free(data);
+        return -1;
+    }
+    data[size] = 0;
+
+    if (type == 'L') {
+        free(t->longname);
+        t->longname = data;
+        return 0;
+    }
+
+    /* records of the form "len key=value\n" */
+    for (rec = data, end = data + size; rec < end;) {
+        char *key, *eol;
+        long len = strtol(rec, &key, 10);
+
+        if (len <= 0 || len > end - rec || *key != ' ') {
+            break;
+        }
+
+        eol = rec + len - 1;
+        *eol = 0;
+        key++;
+
+        if (!strncmp(key, "path=", 5)) {
+            free(t->longname);
+            t->longname = strdup(key + 5);
+        }
+        else if (!strncmp(key, "size=", 5)) {
+            t->paxsize = strtoll(key + 5, NULL, 10);
+        }
+
+        rec += len;
+    }
+
+    free(data);
+
+    return 0;
+}
+
+/*
+ * Move on to the next regular file in the archive, skipping whatever is
+ * left of the current one. Returns 1 if there is a member to read, and
+ * zero at the end of the archive.
+ */
+static int tar_next(tar_t *t)
+{
+    if (!t->archive) {
+        return 0;
+    }
+
+    if (tar_skip(t, t->remaining + t->pad)) {
+        goto truncated;
+    }
+
+    t->remaining = t->pad = 0;
+
+    for (;;) {
+        unsigned char *h = t->head;
+        long long size;
+        size_t n;
+        int type, i;
+
+        if (t->headlen) {
+            t->headlen = 0;
+        }
+        else if ((n = fread(h, 1, TAR_BLOCK, t->raw)) != TAR_BLOCK) {
+            if (!n && feof(t->raw)) {
+                /* end of the input without the end of archive marker */
+                return 0;
+            }
+            goto truncated;
+        }
+
+        for (i = 0; i < TAR_BLOCK && !h[i]; i++);
+        if (i == TAR_BLOCK) {
+            /* end of archive */
+            return 0;
+        }
+
+        if (!tar_valid(h)) {
+            errno = EBADMSG;
+            goto fail;
+        }
+
+        type = h[156];
+        size = tar_number(h + 124, 12);
+
+        if (t->paxsize >= 0 && type != 'x' && type != 'L') {
+            size = t->paxsize;
+            t->paxsize = -1;
+        }
+
+        t->pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+        if (type == 'x' || type == 'L') {
+            if (tar_extended(t, type, size) || tar_skip(t, t->pad)) {
+                goto truncated;
+            }
+            continue;
+        }
+
+        if (type == '0' || type == '7' || !type) {
+            char name[512];
+
+            if (t->longname) {
+                snprintf(name, sizeof(name), "%s", t->longname);
+            }
+            else if (h[345]) {
+                snprintf(name, sizeof(name), "%.155s/%.100s", h + 345, h);
+            }
+            else {
+                snprintf(name, sizeof(name), "%.100s", h);
+            }
+
+            free(t->longname);
+            t->longname = NULL;
+
+            /* those still referring to the last member have a copy */
+            free(t->member);
+            t->member = strdup(name);
+            t->remaining = size;
+
+            return 1;
+        }
+
+        /* directories, links, global headers and the like */
+        free(t->longname);
+        t->longname = NULL;
+
+        if (tar_skip(t, size + t->pad)) {
+            goto truncated;
+        }
+        t->pad = 0;
+    }
+
+truncated:
+    errno = ferror(t->raw) ? errno : EBADMSG;
+fail:
+    fprintf(stderr, "%s: Could not read '%s': %s\n", t->name, t->path,
+            strerror(errno));
+    *t->failed = 1;
+    t->remaining = t->pad = 0;
+
+    return 0;
+}
+
+/*
+ * Could the len bytes so far be the start of a tar header? The numeric
+ * fields hold octal digits, spaces or NULs, unless the first byte marks
+ * a base-256 number. A newline in the name before any NUL is taken as
+ * text, names holding a newline not being worth waiting for.
+ */
+static int tar_possible(const unsigned char *h, size_t len)
+{
+    const unsigned char *nul = memchr(h, 0, len < 100 ? len : 100);
+    size_t i, end;
+
+    if (memchr(h, '\n', nul ? (size_t)(nul - h) : len < 100 ? len : 100)) {
+        return 0;
+    }
+
+    for (i = 100; i < 156 && i < len; i = end) {
+        end = i < 124 || i >= 148 ? i + 8 : i + 12;
+
+        if (h[i] & 0x80) {
+            continue;
+        }
+
+        for (; i < end && i < len; i++) {
+            if ((h[i] < '0' || h[i] > '7') && h[i] != ' ' && h[i]) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Find out whether the input is a tar archive when it is first read,
+ * rather than when it is opened, so that opening a pipe never waits for
+ * a whole block to arrive. Read through a decoder, the header is taken
+ * as it arrives, and input that cannot be an archive is handed on
+ * without waiting for the rest of the block.
+ */
+static int tar_check(tar_t *t)
+{
+    ssize_t n;
+
+    if (t->checked) {
+        return t->archive;
+    }
+
+    t->checked = 1;
+
+    if (!t->decoder) {
+        t->headlen = fread(t->head, 1, TAR_BLOCK, t->raw);
+    }
+    else {
+        while (t->headlen < TAR_BLOCK && tar_possible(t->head, t->headlen)
+                && (n = decoder_decode(t->decoder, (char *)t->head
+                        + t->headlen, TAR_BLOCK - t->headlen)) > 0) {
+            t->headlen += n;
+        }
+    }
+
+    if (t->headlen == TAR_BLOCK && tar_valid(t->head)) {
+        t->archive = 1;
+        tar_next(t);
+        t->source->member = t->member;
+    }
+
+    return t->archive;
+}
+
+static ssize_t tar_read(void *cookie, char *buf, size_t size)
+{
+    tar_t *t = cookie;
+    size_t n;
+
+    if (!tar_check(t)) {
+        if (t->headpos < t->headlen) {
+            n = t->headlen - t->headpos < size ? t->headlen - t->headpos : size;
+            memcpy(buf, t->head + t->headpos, n);
+            t->headpos += n;
+            return n;
+        }
+        /* hand on what has arrived so far, rather than wait for more */
+        if (t->decoder) {
+            return decoder_decode(t->decoder, buf, size);
+        }
+        n = fread(buf, 1, size, t->raw);
+        return n || !ferror(t->raw) ? (ssize_t)n : -1;
+    }
+
+    if (!t->remaining) {
+        return 0;
+    }
+
+    n = fread(buf, 1, t->remaining < (long long)size ? t->remaining
+            : (long long)size, t->raw);
+    if (!n) {
+        errno = ferror(t->raw) ? errno : EBADMSG;
+        return -1;
+    }
+
+    t->remaining -= n;
+
+    return n;
+}
+
+static int tar_close(void *cookie)
+{
+    tar_t *t = cookie;
+
+    fclose(t->raw);
+    free(t->longname);
+    free(t->member);
+    free(t);
+
+    return 0;
+}
+
+/*
+ * Read an input as a tar archive if it turns out to be one, positioned
+ * at the first member. Input read through a decoder is read unbuffered,
+ * so that the decoder can be read from directly when it is no archive.
+ */
+static FILE *tar_open(xarmour_t *xa, FILE *raw, decoder_t *d,
+        const char *path)
+{
+    cookie_io_functions_t io = { tar_read, NULL, NULL, tar_close };
+    tar_t *t;
+    FILE *in;
+
+    if (!raw) {
+        fprintf(stderr, "%s: Could not read '%s': %s\n", xa->name, path,
+                strerror(errno));
+        return NULL;
+    }
+
+    t = calloc(1, sizeof(tar_t));
+    if (!t) {
+        fprintf(stderr, "%s: Out of memory\n", xa->name);
+        fclose(raw);
+        return NULL;
+    }
+
+    t->raw = raw;
+    t->decoder = d;
+    t->name = xa->name;
+    t->path = path;
+    t->failed = &xa->failed;
+    t->source = &xa->source;
+    t->paxsize = -1;
+
+    in = fopencookie(t, "r", io);
+    if (!in) {
+        fprintf(stderr, "%s: Could not read '%s': %s\n", xa->name, path,
+                strerror(errno));
+        tar_close(t);
+        return NULL;
+    }
+
+    xa->tar = t;
+    xa->source.member = NULL;
+
+    return in;
+}
+
+/*
+ * An armoured text found by a scan: where it begins, where the body
+ * after the BEGIN line begins, where the END line begins, where it ends,
+ * and its index within the file. Armour cut short by the end of the
+ * file has no END line.
+ */
+typedef struct extent_t {
+    long long begin;
+    long long body;
+    long long tail;
+    long long end;
+    long int index;
+} extent_t;
+
+#ifdef HAVE_SCAN
+
+/*
+ * A bounded lock free queue of extents, with any number of threads
+ * pushing and popping. Each slot carries a sequence number saying
+ * whether it is free or full for the current lap around the ring, and
+ * runs of slots are claimed with a single compare and swap, so extents
+ * move a batch at a time.
+ */
+typedef struct ring_slot_t {
+    atomic_size_t seq;
+    extent_t e;
+} ring_slot_t;
+
+typedef struct ring_t {
+    ring_slot_t *slots;
+    size_t mask;
+    char pad1[64];
+    atomic_size_t head;
+    char pad2[64];
+    atomic_size_t tail;
+    char pad3[64];
+} ring_t;
+
+static int ring_init(ring_t *r, size_t size)
+{
+    size_t i;
+
+    r->slots = calloc(size, sizeof(ring_slot_t));
+    if (!r->slots) {
+        return -1;
+    }
+
+    for (i = 0; i < size; i++) {
+        atomic_init(&r->slots[i].seq, i);
+    }
+
+    r->mask = size - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+
+    return 0;
+}
+
+/*
+ * Push up to n extents, returning how many were pushed. Fewer are
+ * pushed when the ring is close to full.
+ */
+static size_t ring_push(ring_t *r, const extent_t *e, size_t n)
+{
+    size_t pos, i, k;
+
+    pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    for (;;) {
+
+        /* how many slots from here are free on this lap */
+        for (k = 0; k < n; k++) {
+            size_t seq = atomic_load_explicit(&r->slots[(pos + k) & r->mask].seq,
+                    memory_order_acquire);
+
+            if (seq != pos + k) {
+                break;
+            }
+        }
+
+        if (!k) {
+            size_t seq = atomic_load_explicit(&r->slots[pos & r->mask].seq,
+                    memory_order_acquire);
+
+            if (seq < pos) {
+                /* full */
+                return 0;
+            }
+
+            /* another thread got here first */
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + k,
+                memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    for (i = 0; i < k; i++) {
+        ring_slot_t *slot = &r->slots[(pos + i) & r->mask];
+
+        slot->e = e[i];
+        atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+    }
+
+    return k;
+}
+
+/*
+ * Pop up to n extents, returning how many were popped.
+ */
+static size_t ring_pop(ring_t *r, extent_t *e, size_t n)
+{
+    size_t pos, i, k;
+
+    pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    for (;;) {
+
+        for (k = 0; k < n; k++) {
+            size_t seq = atomic_load_explicit(&r->slots[(pos + k) & r->mask].seq,
+                    memory_order_acquire);
+
+            if (seq != pos + k + 1) {
+                break;
+            }
+        }
+
+        if (!k) {
+            size_t seq = atomic_load_explicit(&r->slots[pos & r->mask].seq,
+                    memory_order_acquire);
+
+            if (seq < pos + 1) {
+                /* empty */
+                return 0;
+            }
+
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + k,
+                memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    for (i = 0; i < k; i++) {
+        ring_slot_t *slot = &r->slots[(pos + i) & r->mask];
+
+        e[i] = slot->e;
+        atomic_store_explicit(&slot->seq, pos + i + r->mask + 1,
+                memory_order_release);
+    }
+
+    return k;
+}
+
+/*
+ * Wait a little, spinning at first, then giving way to other threads,
+ * then sleeping.
+ */
+static void backoff(int *spins)
+{
+    if (*spins < 64) {
+        (*spins)++;
+    }
+    else if (*spins < 128) {
+        (*spins)++;
+        sched_yield();
+    }
+    else {
+        struct timespec ts = { 0, 50000 };
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+/*
+ * Part of a mapped file searched by one thread. Armour is claimed by
+ * the chunk in which it begins, however far it runs past the chunk.
+ */
+typedef struct chunk_t {
+    long long from;
+    long long to;
+    extent_t *extents;
+    long int nextents;
+    long int aextents;
+    long int pushed;
+    int settled;
+    int failed;
+    atomic_int done;
+} chunk_t;
+
+/*
+ * A plain file mapped into memory, and searched a chunk at a time by
+ * the scan threads. Chunks are searched in any order, but handed over
+ * in turn, so that armour found inside armour claimed by an earlier
+ * chunk can be dropped, and the index of each armoured text follows
+ * from the count of those before it. The armour is then passed through
+ * the ring to be processed, each as its BEGIN line, its body, and its
+ * END line.
+ */
+typedef struct scan_t {
+    struct pool_t *pool;
+    char *map;
+    long long size;
+    long long from;
+    long int nchunks;
+    chunk_t *chunks;
+    pthread_mutex_t lock;
+    atomic_long turn;
+    atomic_long finished;
+    atomic_int stop;
+    atomic_int failed;
+    long long last;
+    long int count;
+    ring_t ring;
+    extent_t batch[64];
+    int nbatch;
+    int ibatch;
+    long long at;
+    int part;
+} scan_t;
+
+/*
+ * A chunk of a file waiting to be searched.
+ */
+typedef struct task_t {
+    scan_t *sc;
+    long int k;
+} task_t;
+
+/*
+ * The tasks queued for one scan thread. The thread takes tasks from
+ * the front, in the order the armour will be processed, while idle
+ * threads steal from the back.
+ */
+typedef struct deque_t {
+    pthread_mutex_t lock;
+    task_t *tasks;
+    long int head;
+    long int tail;
+    long int size;
+} deque_t;
+
+/*
+ * The scan threads, shared by every file searched. The chunks of each
+ * file are queued for one thread, and spread over the others as they
+ * run out of work of their own, so that a few huge files among many
+ * small ones keep every thread busy.
+ */
+typedef struct pool_t {
+    deque_t *deques;
+    pthread_t *threads;
+    int nthreads;
+    int started;
+    atomic_uint next;
+    atomic_long pending;
+    atomic_long stolen;
+    atomic_int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pool_t;
+
+typedef struct worker_t {
+    pool_t *pool;
+    int id;
+} worker_t;
+
+static int deque_push(deque_t *q, const task_t *tasks, long int n)
+{
+    pthread_mutex_lock(&q->lock);
+
+    if (q->tail + n > q->size) {
+
+        /* reclaim the space at the front before growing */
+        memmove(q->tasks, q->tasks + q->head,
+                (q->tail - q->head) * sizeof(task_t));
+        q->tail -= q->head;
+        q->head = 0;
+
+        if (q->tail + n > q->size) {
+            long int size = q->size ? q->size : 64;
+            task_t *t;
+
+            while (size < q->tail + n) {
+                size *= 2;
+            }
+
+            t = realloc(q->tasks, size * sizeof(task_t));
+            if (!t) {
+                pthread_mutex_unlock(&q->lock);
+                return -1;
+            }
+
+            q->tasks = t;
+            q->size = size;
+        }
+    }
+
+    memcpy(q->tasks + q->tail, tasks, n * sizeof(task_t));
+    q->tail += n;
+
+    pthread_mutex_unlock(&q->lock);
+
+    return 0;
+}
+
+static int deque_take(deque_t *q, task_t *task, int steal)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->head < q->tail) {
+        *task = steal ? q->tasks[--q->tail] : q->tasks[q->head++];
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return found;
+}
+
+/*
+ * Copy a line of the map into a terminated buffer, so that it can be
+ * parsed. Returns the offset following the line.
+ */
+static long long scan_copy(const char *map, long long size, long long pos,
+        char *buf)
+{
+    const char *nl = memchr(map + pos, '\n', size - pos);
+    long long eol = nl ? nl - map + 1 : size;
+    long long len = eol - pos < MAX_LINE - 1 ? eol - pos : MAX_LINE - 1;
+
+    memcpy(buf, map + pos, len);
+    buf[len] = 0;
+
+    return eol;
+}
+
+/*
+ * Find the next line starting with the given marker, at or after pos.
+ */
+static long long scan_find(const char *map, long long size, long long pos,
+        const char *marker, size_t mlen)
+{
+    while (pos < size) {
+        const char *p = memmem(map + pos, size - pos, marker, mlen);
+
+        if (!p) {
+            break;
+        }
+
+        if (p == map || p[-1] == '\n') {
+            return p - map;
+        }
+
+        pos = p - map + 1;
+    }
+
+    return -1;
+}
+
+/*
+ * Search a chunk, starting at the first line that begins at or after
+ * the given offset.
+ */
+static int chunk_scan(scan_t *sc, chunk_t *c, long long pos)
+{
+    char buf[MAX_LINE], label[MAX_LINE], elabel[MAX_LINE];
+
+    c->nextents = 0;
+
+    for (;;) {
+        extent_t e = { 0 };
+        long long p;
+
+        p = scan_find(sc->map, sc->size, pos, "-----BEGIN", 10);
+        if (p < 0 || p >= c->to) {
+            break;
+        }
+
+        e.begin = p;
+        e.body = scan_copy(sc->map, sc->size, p, buf);
+
+        if (sscanf(buf, ARMOUR_BEGIN, label) != 1) {
+            pos = e.body;
+            continue;
+        }
+
+        /* the matching END line, wherever it may be */
+        e.tail = e.end = sc->size;
+        for (p = e.body;
+                (p = scan_find(sc->map, sc->size, p, "-----END", 8)) >= 0;) {
+            long long eol = scan_copy(sc->map, sc->size, p, buf);
+
+            if (sscanf(buf, ARMOUR_END, elabel) == 1 && !strcmp(label, elabel)) {
+                e.tail = p;
+                e.end = eol;
+                break;
+            }
+
+            p = eol;
+        }
+
+        if (c->nextents == c->aextents) {
+            long int a = c->aextents ? c->aextents * 2 : 256;
+            extent_t *x = realloc(c->extents, a * sizeof(extent_t));
+
+            if (!x) {
+                return -1;
+            }
+
+            c->extents = x;
+            c->aextents = a;
+        }
+
+        c->extents[c->nextents++] = e;
+
+        pos = e.end;
+    }
+
+    return 0;
+}
+
+/*
+ * Hand over a chunk: drop any armour inside armour from an earlier
+ * chunk, number what is left, and push as much of it to the ring as
+ * fits. Returns 1 once the whole chunk is handed over, 0 if the ring is
+ * full, and -1 if the chunk could not be searched.
+ */
+static int chunk_publish(scan_t *sc, chunk_t *c)
+{
+    if (!c->settled) {
+        long int i = 0, j;
+
+        while (i < c->nextents && c->extents[i].begin < sc->last) {
+            i++;
+        }
+
+        /* dropped armour running past the earlier armour hid what follows */
+        if (i && c->extents[i - 1].end > sc->last) {
+            if (chunk_scan(sc, c, sc->last)) {
+                return -1;
+            }
+            i = 0;
+        }
+
+        for (j = i; j < c->nextents; j++) {
+            c->extents[j].index = sc->count++;
+        }
+        if (i < c->nextents) {
+            sc->last = c->extents[c->nextents - 1].end;
+        }
+
+        c->pushed = i;
+        c->settled = 1;
+    }
+
+    while (c->pushed < c->nextents) {
+        size_t n = ring_push(&sc->ring, c->extents + c->pushed,
+                c->nextents - c->pushed);
+
+        if (!n) {
+            return 0;
+        }
+
+        c->pushed += n;
+    }
+
+    free(c->extents);
+    c->extents = NULL;
+
+    return 1;
+}
+
+/*
+ * Hand over every searched chunk whose turn has come, for as long as
+ * the ring has room. Only one thread hands over at a time; a thread
+ * finding another already at it leaves its chunk to that thread, which
+ * looks again once done. Nobody waits on a full ring: what does not fit
+ * is handed over later, by whoever next finds room, the reader of the
+ * ring included. A chunk that could not be searched ends the scan
+ * there, rather than leave a gap.
+ */
+static void scan_publish(scan_t *sc)
+{
+    long int turn;
+    int full = 0;
+
+    do {
+        if (pthread_mutex_trylock(&sc->lock)) {
+            return;
+        }
+
+        turn = atomic_load(&sc->turn);
+
+        while (!atomic_load(&sc->failed) && turn < sc->nchunks
+                && atomic_load(&sc->chunks[turn].done)) {
+            chunk_t *c = &sc->chunks[turn];
+            int rv = c->failed ? -1 : chunk_publish(sc, c);
+
+            if (rv < 0) {
+                atomic_store_explicit(&sc->failed, 1, memory_order_release);
+                break;
+            }
+            if (!rv) {
+                full = 1;
+                break;
+            }
+            atomic_store_explicit(&sc->turn, ++turn, memory_order_release);
+        }
+
+        pthread_mutex_unlock(&sc->lock);
+
+    } while (!full && !atomic_load(&sc->failed) && turn < sc->nchunks
+            && atomic_load(&sc->chunks[turn].done));
+}
+
+static void scan_task(scan_t *sc, long int k)
+{
+    chunk_t *c = &sc->chunks[k];
+
+    if (!atomic_load(&sc->stop)) {
+
+        if (chunk_scan(sc, c, c->from)) {
+            c->failed = 1;
+        }
+
+        atomic_store(&c->done, 1);
+
+        scan_publish(sc);
+    }
+
+    atomic_fetch_add(&sc->finished, 1);
+}
+
+/*
+ * Take the next task, from our own queue if we can, otherwise from the
+ * back of the queue of another thread.
+ */
+static int pool_take(pool_t *pool, int id, task_t *task)
+{
+    int i;
+
+    if (deque_take(&pool->deques[id], task, 0)) {
+        return 1;
+    }
+
+    for (i = 1; i < pool->nthreads; i++) {
+        if (deque_take(&pool->deques[(id + i) % pool->nthreads], task, 1)) {
+            atomic_fetch_add(&pool->stolen, 1);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void *pool_run(void *arg)
+{
+    worker_t *w = arg;
+    pool_t *pool = w->pool;
+    task_t task;
+
+    for (;;) {
+
+        if (atomic_load(&pool->stop)) {
+            break;
+        }
+
+        if (pool_take(pool, w->id, &task)) {
+            atomic_fetch_sub(&pool->pending, 1);
+            scan_task(task.sc, task.k);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!atomic_load(&pool->pending) && !atomic_load(&pool->stop)) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(w);
+
+    return NULL;
+}
+
+/*
+ * Start the scan threads. Without them, plain files are read a line at
+ * a time as usual.
+ */
+static void pool_start(xarmour_t *xa)
+{
+    pool_t *pool;
+    int i;
+
+    pool = calloc(1, sizeof(pool_t));
+    if (!pool) {
+        return;
+    }
+
+    pool->deques = calloc(xa->scan_threads, sizeof(deque_t));
+    pool->threads = calloc(xa->scan_threads, sizeof(pthread_t));
+    if (!pool->deques || !pool->threads) {
+        free(pool->deques);
+        free(pool->threads);
+        free(pool);
+        return;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->stolen, 0);
+    atomic_init(&pool->stop, 0);
+
+    for (i = 0; i < xa->scan_threads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+
+    /* should a thread fail to start, the others steal its work */
+    pool->nthreads = xa->scan_threads;
+
+    for (i = 0; i < pool->nthreads; i++) {
+        worker_t *w = malloc(sizeof(worker_t));
+
+        if (!w) {
+            break;
+        }
+
+        w->pool = pool;
+        w->id = i;
+
+        if (pthread_create(&pool->threads[i], NULL, pool_run, w)) {
+            free(w);
+            break;
+        }
+        pool->started++;
+    }
+
+    if (!pool->started) {
+        free(pool->deques);
+        free(pool->threads);
+        free(pool);
+        return;
+    }
+
+    xa->pool = pool;
+}
+
+/*
+ * Stop the scan threads, leaving any queued chunks unsearched.
+ */
+static void pool_stop(xarmour_t *xa)
+{
+    pool_t *pool = xa->pool;
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stop, 1);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+}
+
+/*
+ * Map a plain file, and queue its chunks to be searched. Returns NULL
+ * if the file cannot be mapped, in which case it is read a line at a
+ * time as usual.
+ */
+static scan_t *scan_open(xarmour_t *xa, int fd, off_t off)
+{
+    pool_t *pool = xa->pool;
+    struct stat st;
+    task_t *tasks;
+    scan_t *sc;
+    long int k;
+
+    if (!pool || fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= off) {
+        return NULL;
+    }
+
+    sc = calloc(1, sizeof(scan_t));
+    if (!sc) {
+        return NULL;
+    }
+
+    sc->pool = pool;
+    sc->size = st.st_size;
+    sc->from = off;
+    sc->nchunks = (sc->size - off + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    pthread_mutex_init(&sc->lock, NULL);
+    atomic_init(&sc->turn, 0);
+    atomic_init(&sc->finished, 0);
+    atomic_init(&sc->stop, 0);
+    atomic_init(&sc->failed, 0);
+
+    sc->map = mmap(NULL, sc->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (sc->map == MAP_FAILED) {
+        free(sc);
+        return NULL;
+    }
+
+    madvise(sc->map, sc->size, MADV_SEQUENTIAL);
+
+    sc->chunks = calloc(sc->nchunks, sizeof(chunk_t));
+    tasks = calloc(sc->nchunks, sizeof(task_t));
+    if (!sc->chunks || !tasks || ring_init(&sc->ring, SCAN_RING)) {
+        goto fail;
+    }
+
+    for (k = 0; k < sc->nchunks; k++) {
+        chunk_t *c = &sc->chunks[k];
+
+        c->from = sc->from + k * SCAN_CHUNK;
+        c->to = c->from + SCAN_CHUNK < sc->size ? c->from + SCAN_CHUNK : sc->size;
+        atomic_init(&c->done, 0);
+
+        tasks[k].sc = sc;
+        tasks[k].k = k;
+    }
+
+    /* the whole file goes to one thread, the others steal from it */
+    if (deque_push(&pool->deques[atomic_fetch_add(&pool->next, 1)
+            % pool->nthreads], tasks, sc->nchunks)) {
+        goto fail;
+    }
+
+    free(tasks);
+
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->pending, sc->nchunks);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return sc;
+
+fail:
+    free(tasks);
+    free(sc->ring.slots);
+    free(sc->chunks);
+    munmap(sc->map, sc->size);
+    free(sc);
+
+    return NULL;
+}
+
+/*
+ * Close a scan once every queued chunk has been taken care of. Chunks
+ * not yet searched are skipped.
+ */
+static void scan_close(scan_t *sc)
+{
+    long int k;
+    int spins = 0;
+
+    atomic_store(&sc->stop, 1);
+
+    while (atomic_load(&sc->finished) < sc->nchunks) {
+        backoff(&spins);
+    }
+
+    for (k = 0; k < sc->nchunks; k++) {
+        free(sc->chunks[k].extents);
+    }
+
+    munmap(sc->map, sc->size);
+    pthread_mutex_destroy(&sc->lock);
+    free(sc->ring.slots);
+    free(sc->chunks);
+    free(sc);
+}
+
+/*
+ * Take the next armoured text from the ring, waiting for the scan
+ * threads if need be. Returns NULL once the whole file is searched.
+ */
+static extent_t *scan_take(xarmour_t *xa, scan_t *sc)
+{
+    int spins = 0;
+
+    while (sc->ibatch == sc->nbatch) {
+
+        sc->ibatch = 0;
+        sc->nbatch = ring_pop(&sc->ring, sc->batch, 64);
+
+        if (sc->nbatch) {
+            break;
+        }
+
+        /* hand over what did not fit while the ring was full */
+        scan_publish(sc);
+
+        sc->nbatch = ring_pop(&sc->ring, sc->batch, 64);
+        if (sc->nbatch) {
+            break;
+        }
+
+        /* every chunk handed over, and the ring drained since */
+        if (atomic_load_explicit(&sc->turn, memory_order_acquire)
+                == sc->nchunks
+                || atomic_load_explicit(&sc->failed, memory_order_acquire)) {
+            sc->nbatch = ring_pop(&sc->ring, sc->batch, 64);
+            if (!sc->nbatch) {
+                if (atomic_load(&sc->failed)) {
+                    fprintf(stderr, "%s: Could not read '%s': Out of memory\n",
+                            xa->name, xa->source.path ? xa->source.path
+                                    : "stdin");
+                    xa->failed = 1;
+                }
+                return NULL;
+            }
+            break;
+        }
+
+        backoff(&spins);
+    }
+
+    return &sc->batch[sc->ibatch];
+}
+
+/*
+ * Hand out the next part of the next armoured text: the BEGIN line,
+ * the body a piece at a time, then the END line. The lines are copied
+ * into the buffer to be parsed. Returns zero at the end of the file.
+ */
+static int scan_next(xarmour_t *xa, scan_t *sc, char *buffer,
+        const char **line, size_t *len, int *body, long long *offset)
+{
+    extent_t *e;
+
+    for (;;) {
+
+        if (!(e = scan_take(xa, sc))) {
+            return 0;
+        }
+
+        switch (sc->part) {
+        case 0:
+            scan_copy(sc->map, sc->size, e->begin, buffer);
+            *line = sc->map + e->begin;
+            *len = e->body - e->begin;
+            *body = 0;
+            sc->at = e->body;
+            sc->part = 1;
+            break;
+        case 1:
+            if (sc->at == e->tail) {
+                sc->part = 2;
+                continue;
+            }
+            *line = sc->map + sc->at;
+            *len = e->tail - sc->at < SCAN_BODY ? e->tail - sc->at : SCAN_BODY;
+            *body = 1;
+            sc->at += *len;
+            break;
+        default:
+            sc->part = 0;
+            sc->ibatch++;
+            if (e->tail == e->end) {
+                /* cut short, there is no END line */
+                continue;
+            }
+            scan_copy(sc->map, sc->size, e->tail, buffer);
+            *line = sc->map + e->tail;
+            *len = e->end - e->tail;
+            *body = 0;
+            sc->at = e->end;
+            break;
+        }
+
+        *offset = sc->at;
+
+        return 1;
+    }
+}
+
+#endif
+
+/*
+ * Read a line of up to size - 1 bytes, like fgets(), but returning the
+ * number of bytes read, NUL bytes included, so that offsets into the
+ * input stay true. The buffer is filled with newlines beforehand, so
+ * that a line holding a NUL can be told apart by the last NUL in the
+ * buffer, which is the one fgets() added.
+ */
+static size_t input_gets(FILE *in, char *buf, size_t size)
+{
+    size_t n;
+
+    memset(buf, '\n', size);
+
+    if (!fgets(buf, size, in)) {
+        return 0;
+    }
+
+    n = strlen(buf);
+
+    if ((n && buf[n - 1] == '\n') || n == size - 1) {
+        return n;
+    }
+
+    return (char *)memrchr(buf, 0, size) - buf;
+}
+
+/*
+ * Read the next line of the input, or when searching a mapped file, the
+ * next part of the next armoured text. Returns zero at the end of the
+ * input.
+ */
+static int input_line(xarmour_t *xa, FILE *in, char *buffer,
+        const char **line, size_t *len, int *body, long long *offset)
+{
+#ifdef HAVE_SCAN
+    if (xa->scan) {
+        return scan_next(xa, xa->scan, buffer, line, len, body, offset);
+    }
+#endif
+
+    if (!(*len = input_gets(in, buffer, MAX_LINE))) {
+        return 0;
+    }
+
+    *line = buffer;
+    *body = 0;
+
+    /* a line still being written is read again once complete */
+    if (xa->following && buffer[*len - 1] != '\n' && *len < MAX_LINE - 1
+            && feof(in)) {
+        xa->follow_end = ftello(in);
+        fseeko(in, -(off_t)*len, SEEK_CUR);
+        return 0;
+    }
+
+    *offset += *len;
+
+    return 1;
+}
+
+/*
+ * Open a stream on an input, decompressing it on the fly if it starts
+ * with the magic of a compression format we know, and reading it member
+ * by member if it is a tar archive. Plain files are read as is, plain
+ * pipes are read through a decoder that passes on the bytes we peeked
+ * at.
+ */
+static FILE *input_fdopen(xarmour_t *xa, int fd, const char *path)
+{
+    cookie_io_functions_t io = { decoder_read, NULL, NULL, decoder_close };
+    unsigned char magic[TAR_BLOCK];
+    decoder_t *d;
+    decoder_e kind;
+    int tar;
+    off_t off;
+    ssize_t n = 0, r;
+    FILE *in;
+
+    off = lseek(fd, 0, SEEK_CUR);
+
+    if (off >= 0) {
+        n = pread(fd, magic, sizeof(magic), off);
+    }
+
+    /* from a pipe, wait for no more than the compression magic */
+    else {
+        while (n < DECODE_MAGIC
+                && ((r = read(fd, magic + n, DECODE_MAGIC - n)) > 0
+                        || (r < 0 && errno == EINTR))) {
+            n += r > 0 ? r : 0;
+        }
+    }
+
+    kind = decoder_detect(magic, n > 0 ? n : 0);
+    tar = kind == DECODE_NONE && n == TAR_BLOCK && tar_valid(magic);
+
+    if (kind == DECODE_NONE && off >= 0) {
+
+        if (tar) {
+            return tar_open(xa, fdopen(fd, "r"), NULL, path);
+        }
+
+        /* the last input may be followed as it grows */
+        if (xa->follow && xa->scanned == xa->ninputs) {
+            struct stat st;
+
+            if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+                xa->following = 1;
+                return fdopen(fd, "r");
+            }
+        }
+
+#ifdef HAVE_SCAN
+        /* a plain file, searched in parallel if asked */
+        if (!xa->scan) {
+            xa->scan = scan_open(xa, fd, off);
+        }
+#endif
+
+        return fdopen(fd, "r");
+    }
+
+    d = calloc(1, sizeof(decoder_t));
+    if (!d) {
+        fprintf(stderr, "%s: Out of memory\n", xa->name);
+        close(fd);
+        return NULL;
+    }
+
+    d->kind = kind;
+    d->fd = fd;
+    d->out = -1;
+    d->name = xa->name;
+    d->path = path;
+#ifdef HAVE_DECODE_THREAD
+    d->failed = &xa->decode_failed;
+#endif
+
+    /* what we peeked at from a pipe is gone, and must be replayed */
+    if (off < 0 && n > 0) {
+        memcpy(d->in, magic, n);
+        d->next = d->in;
+        d->avail = n;
+    }
+
+    switch (kind) {
+    case DECODE_NONE:
+        break;
+#ifdef HAVE_ZLIB
+    case DECODE_GZIP:
+        /* gzip headers only */
+        if (inflateInit2(&d->z, 16 + MAX_WBITS) != Z_OK) {
+            d->kind = DECODE_NONE;
+            errno = ENOMEM;
+            goto fail;
+        }
+        break;
+#endif
+#ifdef HAVE_LZMA
+    case DECODE_XZ:
+        if (lzma_stream_decoder(&d->x, UINT64_MAX, LZMA_CONCATENATED)
+                != LZMA_OK) {
+            d->kind = DECODE_NONE;
+            errno = ENOMEM;
+            goto fail;
+        }
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case DECODE_ZSTD:
+        d->zs = ZSTD_createDStream();
+        if (!d->zs) {
+            d->kind = DECODE_NONE;
+            errno = ENOMEM;
+            goto fail;
+        }
+        ZSTD_initDStream(d->zs);
+        break;
+#endif
+    default:
+        fprintf(stderr, "%s: Could not read '%s': %s compression not "
+                "supported\n", xa->name, path, decoder_names[kind]);
+        d->kind = DECODE_NONE;
+        decoder_free(d);
+        return NULL;
+    }
+
+#ifdef HAVE_DECODE_THREAD
+    if (kind == DECODE_ZSTD) {
+        int pipefd[2];
+        pthread_t thread;
+
+        if (pipe(pipefd)) {
+            goto fail;
+        }
+
+        fcntl(pipefd[READ_FD], F_SETFD, FD_CLOEXEC);
+        fcntl(pipefd[WRITE_FD], F_SETFD, FD_CLOEXEC);
+
+        d->out = pipefd[WRITE_FD];
+
+        if (pthread_create(&thread, NULL, decoder_run, d)) {
+            close(pipefd[READ_FD]);
+            close(pipefd[WRITE_FD]);
+            goto fail;
+        }
+
+        pthread_detach(thread);
+
+        return tar_open(xa, fdopen(pipefd[READ_FD], "r"), NULL, path);
+    }
+#endif
+
+    in = fopencookie(d, "r", io);
+    if (!in) {
+        goto fail;
+    }
+
+    /* the decompressed input or the pipe may yet turn out to be an archive */
+    setvbuf(in, NULL, _IONBF, 0);
+
+    return tar_open(xa, in, d, path);
+
+fail:
+    fprintf(stderr, "%s: Could not read '%s': %s\n", xa->name, path,
+            strerror(errno));
+    decoder_free(d);
+
+    return NULL;
+}
+
+/*
+ * Is the input at its current offset a plain file, neither compressed
+ * nor an archive, that we can seek within?
+ */
+static int input_plain(int fd)
+{
+    unsigned char magic[TAR_BLOCK];
+    off_t off;
+    ssize_t n;
+
+    off = lseek(fd, 0, SEEK_CUR);
+    if (off < 0) {
+        return 0;
+    }
+
+    n = pread(fd, magic, sizeof(magic), off);
+
+    return decoder_detect(magic, n > 0 ? n : 0) == DECODE_NONE
+            && !(n == TAR_BLOCK && tar_valid(magic));
+}
+
+/*
+ * Open the input we were reading when the checkpoint was written, and
+ * move on to where we left off. Plain files are read from the offset
+ * onwards, while everything else, pipes, compressed files and archive
+ * members included, is read up to the offset and thrown away.
+ */
+static FILE *input_resume(xarmour_t *xa, int fd, const char *path)
+{
+    char buf[16384];
+    long long skip = xa->resume_offset;
+    FILE *in;
+
+    xa->resuming = 0;
+
+    if (!xa->resume_member && input_plain(fd)
+            && lseek(fd, skip, SEEK_CUR) >= 0) {
+        skip = 0;
+    }
+
+    in = input_fdopen(xa, fd, path);
+    if (!in) {
+        return NULL;
+    }
+
+    if (xa->resume_member) {
+        while (!xa->tar || !tar_check(xa->tar)
+                || strcmp(xa->tar->member, xa->resume_member)) {
+            if (!xa->tar || !tar_next(xa->tar)) {
+                fprintf(stderr, "%s: Could not resume '%s': member '%s' not "
+                        "found\n", xa->name, path, xa->resume_member);
+                fclose(in);
+                return NULL;
+            }
+        }
+        xa->source.member = xa->tar->member;
+    }
+
+    while (skip > 0) {
+        size_t want = skip < (long long)sizeof(buf) ? (size_t)skip : sizeof(buf);
+        size_t n = fread(buf, 1, want, in);
+
+        if (!n) {
+            fprintf(stderr, "%s: Could not resume '%s': shorter than the "
+                    "checkpoint\n", xa->name, path);
+            fclose(in);
+            return NULL;
+        }
+
+        skip -= n;
+    }
+
+    return in;
+}
+
+#ifdef HAVE_SCAN
+/*
+ * Queue the plain files the readers have opened ahead of us to be
+ * searched, so that the scan threads need never wait for us to reach
+ * them.
+ */
+static void inputs_scan(xarmour_t *xa)
+{
+    long int i;
+
+    if (!xa->pool || !xa->nreaders) {
+        return;
+    }
+
+    for (i = xa->scanned; i < xa->ninputs && i < xa->scanned + READ_AHEAD;
+            i++) {
+        input_t *input = &xa->inputs[i];
+        int ready;
+
+        pthread_mutex_lock(&xa->lock);
+        ready = input->ready;
+        pthread_mutex_unlock(&xa->lock);
+
+        if (!ready) {
+            break;
+        }
+
+        if (input->checked || input->fd < 0) {
+            continue;
+        }
+
+        /* a followed file grows, and cannot be mapped */
+        if (xa->follow && i == xa->ninputs - 1) {
+            break;
+        }
+
+        /* a file resumed from is searched from the checkpoint */
+        if (xa->resuming && i <= xa->resume_input) {
+            continue;
+        }
+
+        input->checked = 1;
+
+        /* compressed files and archives are read as a stream */
+        if (!input_plain(input->fd)) {
+            continue;
+        }
+
+        input->scan = scan_open(xa, input->fd,
+                lseek(input->fd, 0, SEEK_CUR));
+    }
+}
+#endif
+
+/*
+ * Move on to the next member of the archive being read, or to the next
+ * input, in order. Inputs that cannot be opened are reported and
+ * skipped. Returns NULL once all inputs have been read.
+ */
+static FILE *input_next(xarmour_t *xa, FILE *in)
+{
+    if (in && xa->tar && tar_next(xa->tar)) {
+        xa->source.member = xa->tar->member;
+        clearerr(in);
+        return in;
+    }
+
+    if (in) {
+        fclose(in);
+    }
+
+#ifdef HAVE_DECODE_THREAD
+    if (atomic_exchange(&xa->decode_failed, 0)) {
+        xa->failed = 1;
+    }
+#endif
+
+#ifdef HAVE_SCAN
+    if (xa->scan) {
+        scan_close(xa->scan);
+        xa->scan = NULL;
+    }
+#endif
+
+    xa->tar = NULL;
+    xa->source.member = NULL;
+
+    while (xa->scanned < xa->ninputs) {
+        long int n = xa->scanned;
+        input_t *input = &xa->inputs[n];
+
+#ifdef HAVE_PTHREAD
+        if (xa->nreaders) {
+            pthread_mutex_lock(&xa->lock);
+            while (!input->ready) {
+                pthread_cond_wait(&xa->cond, &xa->lock);
+            }
+            xa->scanned++;
+            pthread_cond_broadcast(&xa->cond);
+            pthread_mutex_unlock(&xa->lock);
+        }
+        else
+#endif
+        {
+            if (!xa->resuming || n >= xa->resume_input) {
+                input_open(input);
+            }
+            xa->scanned++;
+        }
+
+        /* inputs read to the end before the checkpoint */
+        if (xa->resuming && n < xa->resume_input) {
+            if (input->fd >= 0) {
+                close(input->fd);
+            }
+            continue;
+        }
+
+        if (input->fd < 0) {
+            fprintf(stderr, "%s: Could not open '%s': %s\n", xa->name,
+                    input->path, strerror(input->err));
+            xa->failed = 1;
+            continue;
+        }
+
+#ifdef HAVE_SCAN
+        xa->scan = input->scan;
+#endif
+
+        if (xa->resuming && xa->resume_path
+                && strcmp(xa->resume_path, input->path)) {
+            fprintf(stderr, "%s: Could not resume: checkpoint '%s' is for "
+                    "'%s', not '%s'\n", xa->name, xa->checkpoint,
+                    xa->resume_path, input->path);
+            close(input->fd);
+            xa->failed = 1;
+            return NULL;
+        }
+
+        in = xa->resuming ? input_resume(xa, input->fd, input->path)
+                : input_fdopen(xa, input->fd, input->path);
+
+        if (!in) {
+#ifdef HAVE_SCAN
+            if (xa->scan) {
+                scan_close(xa->scan);
+                xa->scan = NULL;
+            }
+#endif
+            xa->failed = 1;
+            continue;
+        }
+
+        xa->source.path = input->path;
+
+#ifdef HAVE_SCAN
+        /* the inputs ahead are queued behind this one */
+        inputs_scan(xa);
+#endif
+
+        return in;
+    }
+
+    return NULL;
+}
+
+/*
+ * Record how far we have come: the input, the archive member and the
+ * offset within it following the last armoured text processed, and
+ * the index and count so far. The checkpoint is written alongside and
+ * renamed into place, so that it is never found half written.
+ */
+static int checkpoint_write(xarmour_t *xa, long int input, const char *path,
+        const char *member, long long offset)
+{
+    char tmp[PATH_MAX];
+    char *slash;
+    FILE *f;
+    int fd;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", xa->checkpoint)
+            >= (int)sizeof(tmp)) {
+        fprintf(stderr, "%s: Could not write checkpoint '%s': %s\n", xa->name,
+                xa->checkpoint, strerror(ENAMETOOLONG));
+        return EXIT_FAILURE;
+    }
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0 || !(f = fdopen(fd, "w"))) {
+        fprintf(stderr, "%s: Could not write checkpoint '%s': %s\n", xa->name,
+                tmp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return EXIT_FAILURE;
+    }
+
+    fprintf(f, "xarmour-checkpoint 1\n");
+    fprintf(f, "input %ld\n", input);
+    if (path) {
+        fprintf(f, "path %s\n", path);
+    }
+    if (member) {
+        fprintf(f, "member %s\n", member);
+    }
+    fprintf(f, "offset %lld\n", offset);
+    fprintf(f, "index %ld\n", xa->index);
+    fprintf(f, "count %ld\n", xa->count);
+    fprintf(f, "counted %ld\n", xa->counted);
+
+    if (fflush(f) || fsync(fileno(f))) {
+        fprintf(stderr, "%s: Could not write checkpoint '%s': %s\n", xa->name,
+                tmp, strerror(errno));
+        fclose(f);
+        unlink(tmp);
+        return EXIT_FAILURE;
+    }
+
+    fclose(f);
+
+    if (rename(tmp, xa->checkpoint)) {
+        fprintf(stderr, "%s: Could not write checkpoint '%s': %s\n", xa->name,
+                xa->checkpoint, strerror(errno));
+        unlink(tmp);
+        return EXIT_FAILURE;
+    }
+
+    /* the rename is only safe from a crash once the directory is synced */
+    slash = strrchr(tmp, '/');
+    if (slash == tmp) {
+        tmp[1] = 0;
+    }
+    else if (slash) {
+        *slash = 0;
+    }
+    else {
+        strcpy(tmp, ".");
+    }
+
+    fd = open(tmp, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (fsync(fd) && errno != EINVAL)) {
+        fprintf(stderr, "%s: Could not sync checkpoint directory '%s': %s\n",
+                xa->name, tmp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &xa->checkpointed);
+
+    return 0;
+}
+
+/*
+ * Read the checkpoint we are to resume from. With no checkpoint yet,
+ * we start from the beginning.
+ */
+static int checkpoint_read(xarmour_t *xa)
+{
+    char *line = NULL, *value;
+    size_t size = 0;
+    ssize_t len;
+    FILE *f;
+    int version = 0;
+
+    f = fopen(xa->checkpoint, "r");
+    if (!f) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "%s: Could not read checkpoint '%s': %s\n", xa->name,
+                xa->checkpoint, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    while ((len = getline(&line, &size, f)) > 0) {
+
+        if (line[len - 1] == '\n') {
+            line[len - 1] = 0;
+        }
+
+        value = strchr(line, ' ');
+        if (!value) {
+            continue;
+        }
+        *value++ = 0;
+
+        if (!strcmp(line, "xarmour-checkpoint")) {
+            version = atoi(value);
+        }
+        else if (!strcmp(line, "input")) {
+            xa->resume_input = atol(value);
+        }
+        else if (!strcmp(line, "path")) {
+            xa->resume_path = strdup(value);
+        }
+        else if (!strcmp(line, "member")) {
+            xa->resume_member = strdup(value);
+        }
+        else if (!strcmp(line, "offset")) {
+            xa->resume_offset = atoll(value);
+        }
+        else if (!strcmp(line, "index")) {
+            xa->index = atol(value);
+        }
+        else if (!strcmp(line, "count")) {
+            xa->count = atol(value);
+        }
+        else if (!strcmp(line, "counted")) {
+            xa->counted = atol(value);
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    if (version != 1) {
+        fprintf(stderr, "%s: Could not read checkpoint '%s': not a checkpoint\n",
+                xa->name, xa->checkpoint);
+        return EXIT_FAILURE;
+    }
+
+    xa->resuming = 1;
+
+    return 0;
+}
+
+/*
+ * Watch the file being followed, and the directory it lives in, so that
+ * we wake as soon as it grows or is replaced. Without inotify, we look
+ * again every so often.
+ */
+static void follow_watch(xarmour_t *xa, int fd, const char *path)
+{
+#ifdef HAVE_INOTIFY_INIT1
+    char name[PATH_MAX];
+
+    if (xa->notify < 0) {
+        xa->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (xa->notify < 0) {
+            return;
+        }
+
+        /* a rotated log is replaced by a new file of the same name */
+        if (path && strlen(path) < sizeof(name)) {
+            char *slash;
+
+            strcpy(name, path);
+            slash = strrchr(name, '/');
+            if (slash) {
+                slash[1] = 0;
+            }
+            inotify_add_watch(xa->notify, slash ? name : ".",
+                    IN_CREATE | IN_MOVED_TO);
+        }
+    }
+
+    snprintf(name, sizeof(name), "/proc/self/fd/%d", fd);
+    inotify_add_watch(xa->notify, name,
+            IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#else
+    (void)xa;
+    (void)fd;
+    (void)path;
+#endif
+}
+
+static void follow_sleep(xarmour_t *xa)
+{
+#ifdef HAVE_INOTIFY_INIT1
+    if (xa->notify >= 0) {
+        struct pollfd p = { xa->notify, POLLIN, 0 };
+        char events[4096];
+
+        if (poll(&p, 1, FOLLOW_INTERVAL) > 0) {
+            while (read(xa->notify, events, sizeof(events)) > 0);
+        }
+
+        return;
+    }
+#endif
+
+    poll(NULL, 0, FOLLOW_INTERVAL);
+}
+
+/*
+ * Wait for the file being followed to grow, to be truncated, or to be
+ * replaced by a new file of the same name, as when a log is rotated.
+ * While we wait, the batch collected so far is passed on, and commands
+ * that finish are reported. Returns 1 when there is more to read, 2
+ * when the file was truncated or replaced and is read from the start,
+ * zero when we are to stop, and -1 on error.
+ */
+static int follow_wait(xarmour_t *xa, FILE **in, batch_t *batch)
+{
+    const char *path = xa->source.path;
+    int fd = fileno(*in);
+    off_t pos = ftello(*in);
+
+    /* a line not yet complete is read again, but we have seen it */
+    if (xa->follow_end > pos) {
+        pos = xa->follow_end;
+    }
+    xa->follow_end = 0;
+
+    if (path && !strcmp(path, "-")) {
+        path = NULL;
+    }
+
+    if (xa->watched != fd) {
+        follow_watch(xa, fd, path);
+        xa->watched = fd;
+    }
+
+    for (;;) {
+        struct stat st, now;
+        siginfo_t info;
+
+        if (fstat(fd, &st)) {
+            fprintf(stderr, "%s: Could not follow '%s': %s\n", xa->name,
+                    path ? path : "stdin", strerror(errno));
+            return -1;
+        }
+
+        if (st.st_size > pos) {
+            clearerr(*in);
+            return 1;
+        }
+
+        if (st.st_size < pos) {
+            fprintf(stderr, "%s: '%s' was truncated, reading from the start\n",
+                    xa->name, path ? path : "stdin");
+
+            if (fseeko(*in, 0, SEEK_SET)) {
+                fprintf(stderr, "%s: Could not follow '%s': %s\n", xa->name,
+                        path ? path : "stdin", strerror(errno));
+                return -1;
+            }
+
+            return 2;
+        }
+
+        /* all read, has a new file taken the place of this one? */
+        if (path && !stat(path, &now)
+                && (now.st_ino != st.st_ino || now.st_dev != st.st_dev)) {
+            int nfd = open(path, O_RDONLY | O_CLOEXEC);
+            FILE *f;
+
+            if (nfd >= 0 && (f = fdopen(nfd, "r"))) {
+                fclose(*in);
+                *in = f;
+
+                follow_watch(xa, nfd, path);
+                xa->watched = nfd;
+
+                return 2;
+            }
+
+            if (nfd >= 0) {
+                close(nfd);
+            }
+        }
+
+        /* the file may not grow for some time, pass on what we have */
+        if (batch_flush(xa, batch)) {
+            return -1;
+        }
+
+        /* report the commands that have finished */
+        memset(&info, 0, sizeof(info));
+        while (xa->running
+                && !waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT)
+                && info.si_pid) {
+            if (children_reap(xa)) {
+                return -1;
+            }
+            memset(&info, 0, sizeof(info));
+        }
+
+        if (xa->halt) {
+            return 0;
+        }
+
+        fflush(stdout);
+        if (xa->results) {
+            fflush(xa->results);
+        }
+
+        follow_sleep(xa);
+    }
+}
+
+int main (int argc, char **argv)
+{
+    xarmour_t xa = { 0 };
+    child_t *child = NULL;
+    builtin_t builtin = { 0 };
+    batch_t batch = { 0 };
+    buffer_t block = { 0 };
+    int spill = -1;
+    const char *split_dir = NULL, *split_name = "{index}.pem";
+    const char *cache_dir = NULL;
+    int dedup = 0;
+    const command_t *batch_cmd = NULL;
+    command_t def;
+    char buffer[MAX_LINE];
+    char blabel[MAX_LINE];
+    char elabel[MAX_LINE];
+
+    const char *begin = ARMOUR_BEGIN;
+    const char *end = ARMOUR_END;
+
+    FILE *in = NULL;
+    const char **files = NULL;
+    int nfiles = 0;
+
+    long long offset = 0, poffset = 0, ended = 0;
+    int c, i, rv, inside = 0, printing = 0, batching = 0;
+
+    xa.name = argv[0];
+    xa.jobs = 1;
+    xa.max_buffered = MAX_BUFFERED;
+    xa.spill_bytes = MAX_SPILL;
+    xa.cache_ttl = CACHE_TTL;
+    xa.cache_size = CACHE_SIZE;
+    xa.notify = -1;
+    xa.watched = -1;
+#ifdef HAVE_DECODE_THREAD
+    atomic_init(&xa.decode_failed, 0);
+#endif
+    builtin.kind = BUILTIN_NONE;
+    builtin.out = -1;
+
+    while ((c = getopt_long(argc, argv, "f:rt:j:khv", long_options, NULL)) != -1) {
+
+        switch (c)
+        {
+        case 'f': {
+            const char **f = realloc(files, (nfiles + 1) * sizeof(char *));
+
+            if (!f) {
+                fprintf(stderr, "%s: Out of memory\n", xa.name);
+                return EXIT_FAILURE;
+            }
+
+            files = f;
+            files[nfiles++] = optarg;
+
+            break;
+        }
+        case 'r':
+            xa.recursive = 1;
+
+            break;
+        case 't':
+            xa.times = strtol(optarg, &optarg, 10);
+
+            if (errno || optarg[0] || xa.times < 1) {
+                return help(xa.name, "Count must be bigger than 0.\n", EXIT_FAILURE);
+            }
+
+            break;
+        case 'j':
+            errno = 0;
+            xa.jobs = strtol(optarg, &optarg, 10);
+
+            if (errno || optarg[0] || xa.jobs < 1) {
+                return help(xa.name, "Jobs must be bigger than 0.\n", EXIT_FAILURE);
+            }
+
+            break;
+        case 'k':
+            xa.keep_order = 1;
+
+            break;
+        case OPT_TAG:
+            xa.tag = 1;
+
+            break;
+        case OPT_ON: {
+            route_t *routes;
+            char **args;
+            char *eq = strchr(optarg, '=');
+
+            if (!eq || eq == optarg) {
+                return help(xa.name, "Route must be in the form 'pattern=command'.\n",
+                        EXIT_FAILURE);
+            }
+
+            routes = realloc(xa.routes, (xa.nroutes + 1) * sizeof(route_t));
+            if (!routes) {
+                fprintf(stderr, "%s: Out of memory\n", xa.name);
+                return EXIT_FAILURE;
+            }
+            xa.routes = routes;
+
+            *eq = 0;
+            routes[xa.nroutes].pattern = optarg;
+            args = args_split(eq + 1);
+
+            if (!args || !args[0]) {
+                return help(xa.name, "Route command must not be empty, and quotes must be closed.\n",
+                        EXIT_FAILURE);
+            }
+
+            if ((rv = command_init(xa.name, &routes[xa.nroutes].cmd, args))) {
+                return rv;
+            }
+
+            if (routes[xa.nroutes].cmd.builtin == BUILTIN_COUNT) {
+                xa.counting = 1;
+            }
+
+            if ((rv = pattern_add(xa.name, &xa.router, optarg, xa.nroutes))) {
+                return rv;
+            }
+
+            xa.nroutes++;
+
+            break;
+        }
+        case OPT_LABEL:
+            if ((rv = pattern_add(xa.name, &xa.include, optarg, 0))) {
+                return rv;
+            }
+
+            xa.ninclude++;
+
+            break;
+        case OPT_EXCLUDE_LABEL:
+            if ((rv = pattern_add(xa.name, &xa.exclude, optarg, 0))) {
+                return rv;
+            }
+
+            break;
+        case OPT_INDEX:
+            if (ranges_parse(&xa, optarg)) {
+                return help(xa.name, "Index must be a list of ranges like 0,2-4,7-.\n",
+                        EXIT_FAILURE);
+            }
+
+            break;
+        case OPT_PRINT0:
+            xa.print0 = 1;
+
+            /* fall through */
+        case OPT_PRINT:
+            xa.print = 1;
+
+            break;
+        case OPT_SPLIT_DIR:
+            split_dir = optarg;
+
+            break;
+        case OPT_SPLIT_NAME:
+            split_name = optarg;
+
+            break;
+        case OPT_PREALLOCATE:
+            xa.preallocate = 1;
+
+            break;
+        case OPT_FSYNC:
+            xa.fsync = 1;
+
+            break;
+        case OPT_MAX_BLOCKS:
+            errno = 0;
+            xa.max_blocks = strtol(optarg, &optarg, 10);
+
+            if (errno || optarg[0] || xa.max_blocks < 1) {
+                return help(xa.name, "Max blocks must be bigger than 0.\n", EXIT_FAILURE);
+            }
+
+            break;
+        case OPT_MAX_BYTES:
+            errno = 0;
+            xa.max_bytes = strtoll(optarg, &optarg, 10);
+
+            if (errno || optarg[0] || xa.max_bytes < 1) {
+                return help(xa.name, "Max bytes must be bigger than 0.\n", EXIT_FAILURE);
+            }
+
+            break;
+        case OPT_COUNT_BLOCKS:
+            xa.count_blocks = 1;
+
+            break;
+        case OPT_GROUP_BY_LABEL:
+            xa.group_by_label = 1;
+
+            break;
+        case OPT_MEMFD:
+            xa.memfd = 1;
+
+            break;
+        case OPT_MAX_BUFFERED_BYTES:
+            errno = 0;
+            xa.max_buffered = strtoll(optarg, &optarg, 10);
+
+            if (errno || optarg[0] || xa.max_buffered < 1) {
+                return help(xa.name, "Max buffered bytes must be bigger than 0.\n", EXIT_FAILURE);
+            }
+
+            break;
+        case OPT_STATS:
+            xa.stats = 1;
+
+            break;
+        case OPT_FOLLOW:
+            xa.follow = 1;
+
+            break;
+        case OPT_CHECKPOINT:
+            xa.checkpoint = optarg;
+
+            break;
+        case OPT_RESUME:
+            xa.resume = 1;
+
+            break;
+        case OPT_CACHE:
+            cache_dir = optarg;
+
+            break;
+        case OPT_DEDUP:
+            dedup = 1;
+
+            break;
+        case OPT_DEDUP_COUNT:
+            dedup = 1;
+            xa.dedup_count = 1;
+
+            break;
+        case OPT_CACHE_TTL:
+            errno = 0;
+            xa.cache_ttl = strtoll(optarg, &optarg, 10);
+
+            if (errno || optarg[0] || xa.cache_ttl < 1) {
+                return help(xa.name, "Cache TTL must be bigger than 0.\n", EXIT_FAILURE);
+            }
+
+            break;
+        case OPT_CACHE_SIZE:
+            errno = 0;
+            xa.cache_size = strtoll(optarg, &optarg, 10);
+
+            if (errno || optarg[0] || xa.cache_size < (long long)CACHE_MIN) {
+                return help(xa.name, "Cache size must allow for at least "
+                        "16 entries.\n", EXIT_FAILURE);
+            }
+
+            break;
+        case OPT_SCAN_THREADS:
+            errno = 0;
+            xa.scan_threads = strtol(optarg, &optarg, 10);
+
+            if (errno || optarg[0] || xa.scan_threads < 1) {
+                return help(xa.name, "Scan threads must be bigger than 0.\n", EXIT_FAILURE);
+            }
+
+            break;
+        case OPT_SPILL_BYTES:
+            errno = 0;
+            xa.spill_bytes = strtoll(optarg, &optarg, 10);
+
+            if (errno || optarg[0] || xa.spill_bytes < 1) {
+                return help(xa.name, "Spill bytes must be bigger than 0.\n", EXIT_FAILURE);
+            }
+
+            break;
+        case OPT_RESULTS:
+            if (!strcmp(optarg, "-")) {
+                xa.results = stdout;
+            }
+            else {
+                xa.results = fopen(optarg, "w");
+
+                if (!xa.results) {
+                    fprintf(stderr, "%s: Could not open '%s': %s\n", xa.name,
+                            optarg, strerror(errno));
+
+                    return EXIT_FAILURE;
+                }
+            }
+
+            break;
+        case OPT_RESULTS_OUTPUT:
+            xa.results_output = 1;
+
+            break;
+        case 'h':
+            return help(xa.name, NULL, 0);
+
+        case 'v':
+            return version();
+
+        default:
+            return help(xa.name, NULL, EXIT_FAILURE);
+
+        }
+
+    }
+
+    if (xa.print && split_dir) {
+        fprintf(stderr, "%s: --print cannot be specified with --split-dir.\n", xa.name);
+        return EXIT_FAILURE;
+    }
+
+    /* the armour and the results would be mixed up on stdout */
+    if (xa.print && xa.results == stdout) {
+        fprintf(stderr, "%s: --results - cannot be specified with %s.\n",
+                xa.name, xa.print0 ? "--print0" : "--print");
+        return EXIT_FAILURE;
+    }
+
+    if (xa.resume && !xa.checkpoint) {
+        fprintf(stderr, "%s: --resume needs --checkpoint.\n", xa.name);
+        return EXIT_FAILURE;
+    }
+
+    /* armour printed or split is never collected to be compared */
+    if (dedup && (xa.print || split_dir)) {
+        fprintf(stderr, "%s: %s cannot be specified with %s.\n", xa.name,
+                xa.dedup_count ? "--dedup-count" : "--dedup",
+                split_dir ? "--split-dir" : xa.print0 ? "--print0" : "--print");
+        return EXIT_FAILURE;
+    }
+
+    /* groups mix their armour, the copies cannot find their first */
+    if (xa.dedup_count && xa.group_by_label) {
+        fprintf(stderr, "%s: --dedup-count cannot be specified with "
+                "--group-by-label.\n", xa.name);
+        return EXIT_FAILURE;
+    }
+
+    /* groups are held until the very end, there is no point in between */
+    if (xa.checkpoint && xa.group_by_label) {
+        fprintf(stderr, "%s: --checkpoint cannot be specified with "
+                "--group-by-label.\n", xa.name);
+        return EXIT_FAILURE;
+    }
+
+    if (xa.resume && (rv = checkpoint_read(&xa))) {
+        return rv;
+    }
+
+    if (xa.checkpoint) {
+        clock_gettime(CLOCK_MONOTONIC, &xa.checkpointed);
+    }
+
+    if (split_dir) {
+
+        if (template_parse(&xa.split_name, split_name, (1 << TPL_INDEX)
+                | (1 << TPL_LABEL) | (1 << TPL_FINGERPRINT), 1)) {
+            return help(xa.name, "Split name must only contain the placeholders "
+                    "{index}, {label} and {fingerprint}.\n", EXIT_FAILURE);
+        }
+
+        xa.split_fd = open(split_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (xa.split_fd < 0) {
+            fprintf(stderr, "%s: Could not open '%s': %s\n", xa.name, split_dir,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        xa.print = 1;
+        xa.command = "--split-dir";
+    }
+
+    if (xa.print && (optind < argc || xa.nroutes)) {
+        fprintf(stderr, "%s: A command cannot be specified with %s.\n", xa.name,
+                split_dir ? "--split-dir" : "--print");
+        return EXIT_FAILURE;
+    }
+
+    if (optind == argc && !xa.nroutes && !xa.print) {
+        fprintf(stderr, "%s: No command specified.\n", xa.name);
+        return EXIT_FAILURE;
+    }
+
+    if (split_dir) {
+        /* already set */
+    }
+    else if (xa.print) {
+        xa.command = xa.print0 ? "--print0" : "--print";
+    }
+    else if (optind < argc) {
+        if ((rv = command_init(xa.name, &def, argv + optind))) {
+            return rv;
+        }
+        xa.cmd = &def;
+        xa.command = def.argv[0];
+    }
+    else {
+        xa.command = xa.routes[0].cmd.argv[0];
+    }
+
+    /* each armoured text is collected, then passed on in a file of its own */
+    if (xa.memfd && !xa.max_blocks && !xa.max_bytes) {
+        xa.max_blocks = 1;
+    }
+
+    /* each armoured text is collected, then looked up before it is run */
+    if (cache_dir && !xa.print) {
+
+        /* the key knows nothing of what the placeholders expand to */
+        int varies = xa.cmd && command_varies(xa.cmd);
+
+        for (i = 0; i < xa.nroutes; i++) {
+            varies |= command_varies(&xa.routes[i].cmd);
+        }
+
+        if (varies) {
+            fprintf(stderr, "%s: --cache cannot be specified with a command "
+                    "using {index}, {count}, {offset} or {file}.\n", xa.name);
+            return EXIT_FAILURE;
+        }
+
+        if ((rv = cache_open(&xa, cache_dir))) {
+            return rv;
+        }
+
+        if (!xa.max_blocks && !xa.max_bytes && !xa.group_by_label) {
+            xa.max_blocks = 1;
+        }
+    }
+
+    /* each armoured text is collected, then compared with those before */
+    if (dedup) {
+
+        xa.dedup = calloc(1, sizeof(dedup_t));
+        if (!xa.dedup) {
+            fprintf(stderr, "%s: Out of memory\n", xa.name);
+            return EXIT_FAILURE;
+        }
+
+        if (!xa.max_blocks && !xa.max_bytes && !xa.group_by_label) {
+            xa.max_blocks = 1;
+        }
+    }
+
+    /* a command that ignores its input must not take us down with it */
+    if (!xa.print) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    /* running commands, plus as many again completed and waiting */
+    xa.window = xa.jobs * 2;
+    xa.children = calloc(xa.window, sizeof(child_t));
+    xa.slabs = calloc(xa.window, sizeof(buffer_t));
+    if (!xa.children || !xa.slabs) {
+        fprintf(stderr, "%s: Out of memory\n", xa.name);
+        return EXIT_FAILURE;
+    }
+
+    xa.capture = (xa.results && xa.results_output) || xa.jobs > 1
+            || xa.keep_order || xa.tag;
+
+    /* directories are expanded up front, the files are read in turn */
+    for (i = 0; i < nfiles; i++) {
+        struct stat st;
+
+        if (strcmp(files[i], "-") && stat(files[i], &st)) {
+            fprintf(stderr, "%s: Could not open '%s': %s\n", xa.name, files[i],
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        if (strcmp(files[i], "-") && S_ISDIR(st.st_mode)) {
+            int fd = open(files[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if (fd < 0) {
+                fprintf(stderr, "%s: Could not open '%s': %s\n", xa.name,
+                        files[i], strerror(errno));
+                return EXIT_FAILURE;
+            }
+
+            rv = inputs_walk(&xa, fd, files[i]);
+            close(fd);
+        }
+        else {
+            rv = inputs_add(&xa, files[i]);
+        }
+
+        if (rv) {
+            return rv;
+        }
+    }
+
+#ifdef HAVE_SCAN
+    if (xa.scan_threads > 1) {
+        pool_start(&xa);
+    }
+#endif
+
+    if (nfiles) {
+        readers_start(&xa);
+
+        in = input_next(&xa, NULL);
+    }
+    else if (xa.resuming && (xa.resume_input || !xa.resume_path
+            || strcmp(xa.resume_path, "stdin"))) {
+        fprintf(stderr, "%s: Could not resume: checkpoint '%s' is not for "
+                "stdin\n", xa.name, xa.checkpoint);
+        return EXIT_FAILURE;
+    }
+    else {
+        in = xa.resuming ? input_resume(&xa, STDIN_FILENO, "stdin")
+                : input_fdopen(&xa, STDIN_FILENO, "stdin");
+
+        if (!in) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* picking up where we left off */
+    offset = xa.resume_offset;
+
+    while (in) {
+
+        const char *line;
+        size_t len;
+        int body;
+
+        if (!input_line(&xa, in, buffer, &line, &len, &body, &offset)) {
+
+            int more = 0;
+
+            if (ferror(in)) {
+                fprintf(stderr, "%s: Could not read '%s': %s\n", xa.name,
+                        xa.source.path ? xa.source.path : "stdin",
+                        strerror(errno));
+                xa.failed = 1;
+            }
+
+            /* wait for the followed file to grow, armour and all */
+            else if (xa.following) {
+
+                more = follow_wait(&xa, &in, &batch);
+
+                if (more < 0) {
+                    return EXIT_FAILURE;
+                }
+
+                /* more to read, the armour carries on where it was */
+                if (more == 1) {
+                    continue;
+                }
+            }
+
+            /* armour cut short by the end of the file, no further */
+            if (inside) {
+
+                if (child) {
+                    child_drop(&xa, child);
+                    child->truncated = 1;
+
+                    rv = child_close(&xa, child);
+                    child = NULL;
+
+                    if (rv) {
+                        return rv;
+                    }
+                }
+
+                if (spill >= 0) {
+                    close(spill);
+                    spill = -1;
+                }
+
+                if (builtin.kind != BUILTIN_NONE && builtin.out >= 0) {
+                    close(builtin.out);
+                }
+
+                block.len = 0;
+                builtin.kind = BUILTIN_NONE;
+                inside = printing = batching = 0;
+
+                /* the index was given out, the next armour is another */
+                xa.index++;
+            }
+
+            if (!more) {
+                xa.following = 0;
+                in = input_next(&xa, in);
+            }
+            ended = offset;
+            offset = 0;
+
+            continue;
+        }
+
+        if (!inside) {
+
+            /* we are seeking the start of the armour */
+
+            if (!body && sscanf(buffer, begin, blabel) == 1) {
+
+                const command_t *cmd = xa.cmd;
+                int route;
+
+                inside = 1;
+
+                /* past the last index we want, we are done */
+                if (xa.nranges && xa.last >= 0 && xa.index > xa.last) {
+                    break;
+                }
+
+                /* which command handles this label, if any? */
+                route = matcher_match(&xa.router, blabel);
+                if (route >= 0) {
+                    cmd = &xa.routes[route].cmd;
+                }
+
+                /* skipped armour is still counted by the index */
+                if (!armour_wanted(&xa, blabel)) {
+                    cmd = NULL;
+                }
+
+                /* printed armour needs no command at all */
+                else if (xa.print) {
+                    printing = 1;
+                    poffset = offset - len;
+                }
+
+                /* nor do our built in commands */
+                else if (cmd && cmd->builtin != BUILTIN_NONE) {
+                    if ((rv = builtin_begin(&xa, &builtin, cmd))) {
+                        return rv;
+                    }
+                    poffset = offset - len;
+                    cmd = NULL;
+                }
+
+                /* batched armour is collected, and passed on later */
+                else if (cmd && (xa.max_blocks || xa.max_bytes
+                        || xa.group_by_label)) {
+                    batching = 1;
+                    poffset = offset - len;
+                    batch_cmd = cmd;
+                    cmd = NULL;
+                }
+
+                if (cmd) {
+
+                    if ((rv = children_start(&xa, &child, cmd, &xa.source,
+                            blabel, xa.index, xa.index, 1, offset - len, -1,
+                            xa.last_length))) {
+                        return rv;
+                    }
+
+                    if (xa.halt) {
+                        break;
+                    }
+
+                }
+
+            }
+
+        }
+
+        if (inside) {
+
+            /* write the armour */
+
+            if ((printing && split_dir) || batching) {
+
+                if (spill < 0 && block.len + len > (size_t)xa.spill_bytes
+                        && (rv = spill_open(&xa, &spill, &block))) {
+                    return rv;
+                }
+
+                if (spill >= 0) {
+                    if (write_all(spill, line, len)) {
+                        fprintf(stderr, "%s: Could not spill armour: %s\n",
+                                xa.name, strerror(errno));
+                        return EXIT_FAILURE;
+                    }
+                }
+                else if (buffer_append(&block, line, len)) {
+                    fprintf(stderr, "%s: Out of memory\n", xa.name);
+                    return EXIT_FAILURE;
+                }
+
+            }
+
+            else if (printing) {
+
+                fwrite(line, 1, len, stdout);
+
+            }
+
+            else if (builtin.kind != BUILTIN_NONE) {
+
+                builtin_data(&builtin, line, len);
+
+            }
+
+            else if (child) {
+
+                child->length += len;
+
+                if ((rv = child_write(&xa, child, line, len))) {
+                    return rv;
+                }
+
+            }
+
+            /* we are seeking the end of the armour */
+
+            if (!body && sscanf(buffer, end, elabel) == 1
+                    && !strcmp(blabel, elabel)) {
+
+                inside = 0;
+
+                if (printing) {
+
+                    if (split_dir) {
+                        rv = split_write(&xa, blabel, &block, spill);
+                        block.len = 0;
+
+                        if (spill >= 0) {
+                            close(spill);
+                            spill = -1;
+                        }
+
+                        if (rv) {
+                            return rv;
+                        }
+                    }
+                    else if (xa.print0) {
+                        putchar(0);
+                    }
+
+                    results_print(&xa, blabel, poffset, offset - poffset, NULL);
+
+                    printing = 0;
+                    xa.count++;
+                }
+
+                else if (batching) {
+
+                    batching = 0;
+
+                    /* the same armour again need not be passed on again */
+                    if (xa.dedup && (rv = dedup_seen(&xa, &block, spill))) {
+                        rv = rv == 1 ? 0 : rv;
+                    }
+                    else if (xa.group_by_label) {
+                        rv = group_add(&xa, batch_cmd, blabel, &block, spill,
+                                poffset);
+                    }
+                    else {
+                        rv = batch_add(&xa, &batch, batch_cmd, blabel, &block,
+                                spill, poffset);
+                    }
+                    block.len = 0;
+
+                    if (spill >= 0) {
+                        close(spill);
+                        spill = -1;
+                    }
+
+                    if (rv) {
+                        return rv;
+                    }
+
+                }
+
+                else if (builtin.kind != BUILTIN_NONE && builtin.out >= 0) {
+
+                    if ((rv = children_builtin(&xa, &builtin, blabel, poffset,
+                            offset - poffset))) {
+                        return rv;
+                    }
+                }
+
+                else if (builtin.kind != BUILTIN_NONE) {
+
+                    struct timespec start = builtin.start;
+
+                    builtin_end(&xa, &builtin);
+
+                    results_print(&xa, blabel, poffset, offset - poffset, &start);
+
+                    xa.count++;
+                }
+
+                xa.index++;
+
+                if (child) {
+
+                    /* the size of the next armour is likely similar */
+                    xa.last_length = child->length;
+
+                    rv = child_close(&xa, child);
+                    child = NULL;
+
+                    if (rv) {
+                        return rv;
+                    }
+
+                }
+
+                if (xa.halt) {
+                    break;
+                }
+
+                /* once in a while, finish what is running, and record it */
+                if (xa.checkpoint && !batch.blocks) {
+
+                    struct timespec now;
+
+                    clock_gettime(CLOCK_MONOTONIC, &now);
+
+                    if (timespec_diff(&xa.checkpointed, &now)
+                            >= CHECKPOINT_INTERVAL) {
+
+                        while (xa.running) {
+                            if ((rv = children_reap(&xa))) {
+                                return rv;
+                            }
+                        }
+
+                        children_collate(&xa);
+
+                        if (xa.halt) {
+                            break;
+                        }
+
+                        if ((rv = checkpoint_write(&xa,
+                                xa.ninputs ? xa.scanned - 1 : 0,
+                                xa.ninputs ? xa.source.path : "stdin",
+                                xa.source.member, offset))) {
+                            return rv;
+                        }
+                    }
+                }
+
+            }
+
+
+        }
+
+    }
+
+    /* we may have stopped early, the readers need not carry on */
+    readers_stop(&xa);
+#ifdef HAVE_SCAN
+    pool_stop(&xa);
+#endif
+
+    /* pass on what is left of the batch and the groups */
+    if (!xa.halt && (rv = batch_flush(&xa, &batch))) {
+        return rv;
+    }
+
+    for (i = 0; i < xa.ngroups && !xa.halt; i++) {
+        if ((rv = group_flush(&xa, &xa.groups[i]))) {
+            return rv;
+        }
+    }
+
+    /* armour cut short by the end of the input */
+    if (child) {
+        child_drop(&xa, child);
+        child->closed = 1;
+        child->truncated = 1;
+    }
+
+    /* wait for the stragglers */
+    while (xa.running) {
+        if ((rv = children_reap(&xa))) {
+            return rv;
+        }
+    }
+
+    children_collate(&xa);
+
+    /* built in @count reports once everything is counted */
+    if ((xa.cmd && xa.cmd->builtin == BUILTIN_COUNT) || xa.counting) {
+        printf("%ld\n", xa.counted);
+    }
+
+    if (xa.stats) {
+        fprintf(stderr, "%s: peak buffered: %lld bytes, buffers allocated: %ld, "
+                "buffers reused: %ld\n", xa.name, xa.peak_buffered,
+                xa.slabs_allocated, xa.slabs_reused);
+        if (xa.dedup) {
+            fprintf(stderr, "%s: duplicates skipped: %ld\n", xa.name,
+                    xa.dedup->skipped);
+        }
+        if (xa.cache) {
+            fprintf(stderr, "%s: cache hits: %ld, cache misses: %ld\n",
+                    xa.name, xa.cache->hits, xa.cache->misses);
+        }
+#ifdef HAVE_SCAN
+        if (xa.pool) {
+            fprintf(stderr, "%s: chunks searched by a thread other than "
+                    "their own: %ld\n", xa.name, atomic_load(&xa.pool->stolen));
+        }
+#endif
+    }
+
+    if (fflush(stdout)) {
+        fprintf(stderr, "%s: Could not write to stdout: %s\n", xa.name,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (split_dir && xa.fsync && (rv = split_sync(&xa))) {
+        return rv;
+    }
+
+    /* all done, a resume has nothing left to do */
+    if (xa.checkpoint && !xa.halt && !xa.failed
+            && (rv = checkpoint_write(&xa, xa.ninputs,
+                    xa.ninputs ? NULL : "stdin", NULL, xa.ninputs ? 0 : ended))) {
+        return rv;
+    }
+
+    if (xa.halt) {
+        return xa.exit;
+    }
+
+    /* inputs we could not read were reported as we went */
+    if (xa.failed) {
+        return EXIT_FAILURE;
+    }
+
+    if (xa.times) {
+        if (xa.count < xa.times) {
+            fprintf(stderr, "%s: %s: %ld success%s, %ld required: failed\n", xa.name,
+                    xa.command, xa.count, xa.count == 1 ? "" : "es", xa.times);
+            return EXIT_FAILURE;
+        }
+        else {
+            fprintf(stderr, "%s: %s: %ld success%s, %ld required: success\n", xa.name,
+                    xa.command, xa.count, xa.count == 1 ? "" : "es", xa.times);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}